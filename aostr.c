@@ -294,7 +294,7 @@ aoStr *aoStrEscapeString(aoStr *buf) {
     }
 
     while (*ptr) {
-        if (*ptr > 31 && *ptr != '\"' && *ptr != '\\') {
+        if ((unsigned char)*ptr > 31 && *ptr != '\"' && *ptr != '\\') {
             aoStrPutChar(outstr, *ptr);
         } else {
             aoStrPutChar(outstr, '\\');
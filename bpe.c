@@ -0,0 +1,397 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aostr.h"
+#include "bpe.h"
+#include "io.h"
+#include "panic.h"
+
+/* Pieces longer than this have their parts allocated rather than on the
+ * stack */
+#define BPE_STACK_PIECE (256)
+
+#define bpeIsDigit(ch)   ((ch) >= '0' && (ch) <= '9')
+#define bpeIsNewline(ch) ((ch) == '\n' || (ch) == '\r')
+#define bpeIsSpace(ch) \
+    ((ch) == ' ' || (ch) == '\t' || (ch) == '\v' || (ch) == '\f' || \
+     bpeIsNewline(ch))
+/* Anything outside of ascii is part of a multi-byte character, they are
+ * treated as letters */
+#define bpeIsLetter(ch)                                             \
+    (((ch) >= 'a' && (ch) <= 'z') || ((ch) >= 'A' && (ch) <= 'Z') || \
+     (ch) >= 0x80)
+#define bpeIsOther(ch) \
+    (!bpeIsSpace(ch) && !bpeIsLetter(ch) && !bpeIsDigit(ch))
+#define bpeToLower(ch) (((ch) >= 'A' && (ch) <= 'Z') ? (ch) - 'A' + 'a' : (ch))
+
+/* A token, the bytes live in `bpe.bytes`. Empty slots have a `len` of 0 */
+typedef struct bpeEntry {
+    unsigned int hash;
+    unsigned int rank;
+    unsigned int offset;
+    unsigned int len;
+} bpeEntry;
+
+struct bpe {
+    bpeEntry *entries; /* Open addressing, linear probing */
+    size_t capacity;   /* Power of 2 */
+    size_t count;
+    unsigned char *bytes; /* Every token back to back */
+    size_t bytes_len;
+};
+
+/* FNV-1a */
+static unsigned int bpeHash(const unsigned char *bytes, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned int bpeRank(bpe *b, const unsigned char *bytes, size_t len) {
+    unsigned int hash = bpeHash(bytes, len);
+    size_t mask = b->capacity - 1;
+    size_t idx = hash & mask;
+    bpeEntry *e;
+
+    while ((e = &b->entries[idx])->len != 0) {
+        if (e->hash == hash && e->len == len &&
+            !memcmp(b->bytes + e->offset, bytes, len)) {
+            return e->rank;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return BPE_NO_RANK;
+}
+
+static void bpeInsert(bpe *b, unsigned int offset, unsigned int len,
+                      unsigned int rank) {
+    unsigned char *bytes = b->bytes + offset;
+    unsigned int hash = bpeHash(bytes, len);
+    size_t mask = b->capacity - 1;
+    size_t idx = hash & mask;
+    bpeEntry *e;
+
+    while ((e = &b->entries[idx])->len != 0) {
+        /* First one wins */
+        if (e->hash == hash && e->len == len &&
+            !memcmp(b->bytes + e->offset, bytes, len)) {
+            return;
+        }
+        idx = (idx + 1) & mask;
+    }
+
+    e->hash = hash;
+    e->rank = rank;
+    e->offset = offset;
+    e->len = len;
+    b->count++;
+}
+
+static int bpeBase64Value(unsigned char ch) {
+    if (ch >= 'A' && ch <= 'Z') {
+        return ch - 'A';
+    } else if (ch >= 'a' && ch <= 'z') {
+        return ch - 'a' + 26;
+    } else if (bpeIsDigit(ch)) {
+        return ch - '0' + 52;
+    } else if (ch == '+') {
+        return 62;
+    } else if (ch == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+/* Decode [ptr, end) into 'out' returning the number of bytes written or -1 */
+static int bpeBase64Decode(const unsigned char *ptr, const unsigned char *end,
+                           unsigned char *out) {
+    unsigned int acc = 0;
+    int bits = 0, len = 0, val;
+
+    for (; ptr < end && *ptr != '='; ++ptr) {
+        if ((val = bpeBase64Value(*ptr)) == -1) {
+            return -1;
+        }
+        acc = (acc << 6) | val;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[len++] = (acc >> bits) & 0xFF;
+        }
+    }
+    return len;
+}
+
+/**
+ * Load a tiktoken file, for example cl100k_base.tiktoken, each line of which
+ * is a base64 encoded token followed by its rank:
+ *
+ * IQ== 0
+ * Ig== 1
+ *
+ * Returns NULL if the file cannot be read or is malformed.
+ */
+bpe *bpeLoad(char *path) {
+    aoStr *file;
+    unsigned char *ptr, *end, *eol, *space;
+    unsigned long rank;
+    size_t lines = 0;
+    char *num_end;
+    int len;
+    bpe *b;
+
+    if ((file = ioReadFile(path)) == NULL) {
+        return NULL;
+    }
+
+    ptr = (unsigned char *)file->data;
+    end = ptr + file->len;
+    for (unsigned char *p = ptr; p < end; ++p) {
+        if (*p == '\n') {
+            lines++;
+        }
+    }
+
+    b = malloc(sizeof(bpe));
+    /* No more than half full */
+    b->capacity = 16;
+    while (b->capacity < (lines + 1) * 2) {
+        b->capacity <<= 1;
+    }
+    b->entries = calloc(b->capacity, sizeof(bpeEntry));
+    b->count = 0;
+    /* Decoded tokens are always smaller than the file */
+    b->bytes = malloc(file->len);
+    b->bytes_len = 0;
+
+    while (ptr < end) {
+        if ((eol = memchr(ptr, '\n', end - ptr)) == NULL) {
+            eol = end;
+        }
+        if (eol == ptr) {
+            ptr++;
+            continue;
+        }
+
+        if ((space = memchr(ptr, ' ', eol - ptr)) == NULL) {
+            goto malformed;
+        }
+        len = bpeBase64Decode(ptr, space, b->bytes + b->bytes_len);
+        rank = strtoul((char *)space + 1, &num_end, 10);
+        if (len <= 0 || num_end == (char *)space + 1) {
+            goto malformed;
+        }
+
+        bpeInsert(b, b->bytes_len, len, (unsigned int)rank);
+        b->bytes_len += len;
+        ptr = eol + 1;
+    }
+
+    aoStrRelease(file);
+    return b;
+
+malformed:
+    warning("Malformed byte pair encoding file: %s\n", path);
+    aoStrRelease(file);
+    bpeRelease(b);
+    return NULL;
+}
+
+void bpeRelease(bpe *b) {
+    if (b) {
+        free(b->entries);
+        free(b->bytes);
+        free(b);
+    }
+}
+
+/**
+ * Split text the way the cl100k pattern does before encoding, ascii only with
+ * anything else treated as a letter:
+ *
+ * 's|'t|'re|'ve|'m|'ll|'d | [^\r\n\p{L}\p{N}]?\p{L}+ | \p{N}{1,3} |
+ *  ?[^\s\p{L}\p{N}]+[\r\n]* | \s*[\r\n]+ | \s+(?!\S) | \s+
+ *
+ * Returns the end of the piece starting at 'ptr'.
+ */
+static const unsigned char *bpeNextPiece(const unsigned char *ptr,
+                                         const unsigned char *end) {
+    const unsigned char *cur = ptr, *newline = NULL;
+    unsigned char ch;
+
+    /* Contractions */
+    if (*ptr == '\'' && ptr + 1 < end) {
+        ch = bpeToLower(ptr[1]);
+        if (ch == 's' || ch == 't' || ch == 'm' || ch == 'd') {
+            return ptr + 2;
+        }
+        if (ptr + 2 < end) {
+            unsigned char ch2 = bpeToLower(ptr[2]);
+            if ((ch == 'r' && ch2 == 'e') || (ch == 'v' && ch2 == 'e') ||
+                (ch == 'l' && ch2 == 'l')) {
+                return ptr + 3;
+            }
+        }
+    }
+
+    /* A word, optionally preceded by a space or punctuation */
+    if (!bpeIsLetter(*cur) && !bpeIsDigit(*cur) && !bpeIsNewline(*cur) &&
+        cur + 1 < end && bpeIsLetter(cur[1])) {
+        cur++;
+    }
+    if (bpeIsLetter(*cur)) {
+        while (cur < end && bpeIsLetter(*cur)) {
+            cur++;
+        }
+        return cur;
+    }
+
+    /* Up to 3 digits */
+    if (bpeIsDigit(*ptr)) {
+        cur = ptr;
+        while (cur < end && cur - ptr < 3 && bpeIsDigit(*cur)) {
+            cur++;
+        }
+        return cur;
+    }
+
+    /* Punctuation, optionally preceded by a space and followed by newlines */
+    cur = ptr;
+    if (*cur == ' ' && cur + 1 < end && bpeIsOther(cur[1])) {
+        cur++;
+    }
+    if (bpeIsOther(*cur)) {
+        while (cur < end && bpeIsOther(*cur)) {
+            cur++;
+        }
+        while (cur < end && bpeIsNewline(*cur)) {
+            cur++;
+        }
+        return cur;
+    }
+
+    /* Whitespace up to and including the last newline */
+    cur = ptr;
+    while (cur < end && bpeIsSpace(*cur)) {
+        if (bpeIsNewline(*cur)) {
+            newline = cur;
+        }
+        cur++;
+    }
+    if (newline) {
+        return newline + 1;
+    }
+
+    /* Otherwise all but the last space, which goes with what follows */
+    if (cur < end && cur - ptr > 1) {
+        return cur - 1;
+    }
+    return cur;
+}
+
+/**
+ * Merge the lowest ranked adjacent pair until no pair is a token, the number
+ * of parts left is the number of tokens
+ */
+static size_t bpeCountPiece(bpe *b, const unsigned char *piece, size_t len) {
+    size_t stack_starts[BPE_STACK_PIECE + 1];
+    unsigned int stack_ranks[BPE_STACK_PIECE];
+    size_t *starts = stack_starts;
+    unsigned int *ranks = stack_ranks;
+    size_t parts, min_idx;
+    unsigned int min_rank;
+
+    if (len == 1 || bpeRank(b, piece, len) != BPE_NO_RANK) {
+        return 1;
+    }
+
+    if (len > BPE_STACK_PIECE) {
+        starts = malloc(sizeof(size_t) * (len + 1));
+        ranks = malloc(sizeof(unsigned int) * len);
+    }
+
+    /* Part i is [starts[i], starts[i + 1]), ranks[i] is that of part i
+     * merged with part i + 1 */
+    parts = len;
+    for (size_t i = 0; i <= len; ++i) {
+        starts[i] = i;
+    }
+    for (size_t i = 0; i + 1 < parts; ++i) {
+        ranks[i] = bpeRank(b, piece + i, 2);
+    }
+
+    while (parts > 1) {
+        min_rank = BPE_NO_RANK;
+        min_idx = 0;
+        for (size_t i = 0; i + 1 < parts; ++i) {
+            if (ranks[i] < min_rank) {
+                min_rank = ranks[i];
+                min_idx = i;
+            }
+        }
+        if (min_rank == BPE_NO_RANK) {
+            break;
+        }
+
+        /* Merge part min_idx + 1 into min_idx */
+        memmove(starts + min_idx + 1, starts + min_idx + 2,
+                sizeof(size_t) * (parts - min_idx - 1));
+        memmove(ranks + min_idx + 1, ranks + min_idx + 2,
+                sizeof(unsigned int) * (parts > min_idx + 2 ?
+                                                parts - min_idx - 2 :
+                                                0));
+        parts--;
+
+        /* Only the pairs either side of the merge have changed */
+        if (min_idx + 1 < parts) {
+            ranks[min_idx] = bpeRank(b, piece + starts[min_idx],
+                                     starts[min_idx + 2] - starts[min_idx]);
+        }
+        if (min_idx > 0) {
+            ranks[min_idx - 1] = bpeRank(b, piece + starts[min_idx - 1],
+                                         starts[min_idx + 1] -
+                                                 starts[min_idx - 1]);
+        }
+    }
+
+    if (starts != stack_starts) {
+        free(starts);
+        free(ranks);
+    }
+    return parts;
+}
+
+/* Number of tokens 'text' encodes to */
+size_t bpeCountTokens(bpe *b, const char *text, size_t len) {
+    const unsigned char *ptr = (const unsigned char *)text;
+    const unsigned char *end = ptr + len, *next;
+    size_t count = 0;
+
+    if (b == NULL) {
+        return bpeEstimateTokens(text, len);
+    }
+
+    while (ptr < end) {
+        next = bpeNextPiece(ptr, end);
+        count += bpeCountPiece(b, ptr, next - ptr);
+        ptr = next;
+    }
+    return count;
+}
+
+/* Without the tables, english averages around 4 bytes a token */
+size_t bpeEstimateTokens(const char *text, size_t len) {
+    (void)text;
+    return (len + 3) / 4;
+}
@@ -0,0 +1,24 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef BPE_H
+#define BPE_H
+
+#include <stddef.h>
+
+/* Rank of a byte sequence that is not a token */
+#define BPE_NO_RANK (0xFFFFFFFFu)
+
+/* Byte pair encoding tables, see `bpeLoad` */
+typedef struct bpe bpe;
+
+bpe *bpeLoad(char *path);
+void bpeRelease(bpe *b);
+unsigned int bpeRank(bpe *b, const unsigned char *bytes, size_t len);
+size_t bpeCountTokens(bpe *b, const char *text, size_t len);
+size_t bpeEstimateTokens(const char *text, size_t len);
+
+#endif
@@ -8,13 +8,16 @@
 #include <ctype.h>
 #include <errno.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
 #include <unistd.h>
 
 #include "aostr.h"
 #include "dict.h"
+#include "http.h"
 #include "io.h"
 #include "json-selector.h"
 #include "json.h"
@@ -22,6 +25,13 @@
 #include "openai.h"
 #include "panic.h"
 
+/* Prompts kept in the line history, searched with Ctrl-R */
+#define CLI_HISTORY_MAX_LEN (10000)
+
+/* Keys that stop an answer while it is streaming */
+#define CLI_KEY_CTRL_C (3)
+#define CLI_KEY_ESC    (27)
+
 typedef void commandHandlerFunction(openAiCtx *ctx, char *line);
 
 typedef struct openAiCommand {
@@ -39,6 +49,7 @@ static void commandChatList(openAiCtx *ctx, char *line);
 static void commandChatRename(openAiCtx *ctx, char *line);
 static void commandChatLoad(openAiCtx *ctx, char *line);
 static void commandChatDel(openAiCtx *ctx, char *line);
+static void commandSearch(openAiCtx *ctx, char *line);
 static void commandChatHistoryList(openAiCtx *ctx, char *line);
 static void commandChatHistoryClear(openAiCtx *ctx, char *line);
 static void commandChatHistoryDel(openAiCtx *ctx, char *line);
@@ -50,6 +61,10 @@ static void commandSetVerbose(openAiCtx *ctx, char *line);
 static void commandSetTopP(openAiCtx *ctx, char *line);
 static void commandSetPresencePenalty(openAiCtx *ctx, char *line);
 static void commandSetTemperature(openAiCtx *ctx, char *line);
+static void commandSetContext(openAiCtx *ctx, char *line);
+static void commandSetCache(openAiCtx *ctx, char *line);
+static void commandSetFrame(openAiCtx *ctx, char *line);
+static void commandSetMarkdown(openAiCtx *ctx, char *line);
 
 static openAiCommand readonly_command[] = {
         {"", commandChat},
@@ -69,12 +84,17 @@ static openAiCommand readonly_command[] = {
         {"/chat-list", commandChatList},
         {"/chat-rename", commandChatRename},
         {"/chat-del", commandChatDel},
+        {"/search", commandSearch},
 
         {"/set-model", commandSetModel},
         {"/set-verbose", commandSetVerbose},
         {"/set-top_p", commandSetTopP},
         {"/set-presence-pen", commandSetPresencePenalty},
         {"/set-temperature", commandSetTemperature},
+        {"/set-context", commandSetContext},
+        {"/set-cache", commandSetCache},
+        {"/set-frame", commandSetFrame},
+        {"/set-markdown", commandSetMarkdown},
 
         {"/exit", commandExit},
         {"/help", commandHelp},
@@ -122,7 +142,9 @@ cliCommandInfo cli_info[] = {
          {"/chat-load", "/chat-list", "/chat-rename", "/chat-del"},
          4},
 
-        {"/set-model", "/set-m", " /set-model <model_id>", {"/set-model"}, 1},
+        {"/search", "/sea", " /search <words>", {"/search"}, 1},
+
+        {"/set-model", "/set-mo", " /set-model <model_id>", {"/set-model"}, 1},
         {"/set-verbose", "/set-v", " /set-verbose <1|0>", {"/set-verbose"}, 1},
         {"/set-top_p", "/set-to", " /set-top_p <float>", {"/set-top_p"}, 1},
         {"/set-presence-pen",
@@ -135,31 +157,189 @@ cliCommandInfo cli_info[] = {
          " /set-temperature <float>",
          {"/set-temperature"},
          1},
+        {"/set-context",
+         "/set-co",
+         " /set-context <tokens>",
+         {"/set-context"},
+         1},
+        {"/set-cache",
+         "/set-ca",
+         " /set-cache <ttl_seconds> [max_mb]",
+         {"/set-cache"},
+         1},
+        {"/set-frame", "/set-f", " /set-frame <ms>", {"/set-frame"}, 1},
+        {"/set-markdown",
+         "/set-ma",
+         " /set-markdown <1|0>",
+         {"/set-markdown"},
+         1},
+        {"/set-m",
+         "/set-m",
+         " /set-<model | markdown>",
+         {"/set-model", "/set-markdown"},
+         2},
         {"/set",
          "/set",
-         " /set-<model | verbose | top_p | presence-pen | temperature>",
+         " /set-<model | verbose | top_p | presence-pen | temperature | context | cache | frame | markdown>",
          {"/set-model", "/set-verbose", "/set-top_p", "/set-presence-pen",
-          "/set-temperature"},
-         5},
+          "/set-temperature", "/set-context", "/set-cache", "/set-frame",
+          "/set-markdown"},
+         9},
 
         {"/exit", "/ex", " /exit", {"/exit"}, 1},
         {"/help", "/he", " /help", {"/help"}, 1},
 };
 
+/* The terminal as it was before an answer started streaming, and as it is
+ * while it streams */
+static struct termios cli_stream_termios;
+static struct termios cli_stream_raw_termios;
+static int cli_stream_raw = 0;
+
+/* Still delivered while an answer streams, the terminal has to be put back
+ * before they end or stop the program as `atexit` handlers do not run */
+static int cli_stream_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGTSTP};
+static struct sigaction
+        cli_stream_old_actions[sizeof(cli_stream_signals) / sizeof(int)];
+
+static void cliStreamRestoreTerminal(void) {
+    if (cli_stream_raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &cli_stream_termios);
+        cli_stream_raw = 0;
+    }
+}
+
+static void cliStreamSignalSet(int sig, void (*handler)(int)) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+/* Put the terminal back and let the signal do what it would have done. Only
+ * async-signal-safe calls in here */
+static void cliStreamSignal(int sig) {
+    int saved_errno = errno;
+    sigset_t mask;
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &cli_stream_termios);
+    cliStreamSignalSet(sig, SIG_DFL);
+    sigemptyset(&mask);
+    sigaddset(&mask, sig);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    raise(sig);
+
+    /* Only gets here once continued after Ctrl-Z, or if the stop was
+     * ignored, the answer carries on streaming */
+    cliStreamSignalSet(sig, cliStreamSignal);
+    tcsetattr(STDIN_FILENO, TCSANOW, &cli_stream_raw_termios);
+    errno = saved_errno;
+}
+
+/* Signals that are ignored, as by nohup, stay ignored */
+static void cliStreamSignalsWatch(void) {
+    int count = sizeof(cli_stream_signals) / sizeof(cli_stream_signals[0]);
+
+    for (int i = 0; i < count; ++i) {
+        sigaction(cli_stream_signals[i], NULL, &cli_stream_old_actions[i]);
+        if (cli_stream_old_actions[i].sa_handler != SIG_IGN) {
+            cliStreamSignalSet(cli_stream_signals[i], cliStreamSignal);
+        }
+    }
+}
+
+static void cliStreamSignalsUnwatch(void) {
+    int count = sizeof(cli_stream_signals) / sizeof(cli_stream_signals[0]);
+
+    for (int i = 0; i < count; ++i) {
+        sigaction(cli_stream_signals[i], &cli_stream_old_actions[i], NULL);
+    }
+}
+
+/* Keys pressed while an answer is streaming, Ctrl-C or Esc on its own stop
+ * it. An escape sequence like an arrow key arrives all at once so is not
+ * taken for Esc. Everything else is the start of the next prompt and is
+ * handed to linenoise, which shows it once the prompt is up */
+static void cliStreamKey(httpLoop *loop, int fd, void *privdata) {
+    openAiCtx *ctx = (openAiCtx *)privdata;
+    char buf[64];
+    ssize_t nread, start = 0;
+
+    if ((nread = read(fd, buf, sizeof(buf))) <= 0) {
+        httpLoopWatch(loop, -1, NULL, NULL);
+        return;
+    }
+
+    if (nread == 1 && buf[0] == CLI_KEY_ESC) {
+        openAiCtxCancel(ctx);
+        return;
+    }
+
+    for (ssize_t i = 0; i < nread; ++i) {
+        if (buf[i] == CLI_KEY_CTRL_C) {
+            linenoiseTypeahead(buf + start, i - start);
+            openAiCtxCancel(ctx);
+            start = i + 1;
+        }
+    }
+    linenoiseTypeahead(buf + start, nread - start);
+}
+
+/* Stream the answer while watching the terminal for a key to stop it. The
+ * terminal stops waiting for a newline and Ctrl-C becomes a key rather than
+ * killing the program, along with the session, until the answer is over.
+ * Any other signal that would end or stop the program puts the terminal
+ * back first */
+static void cliChatStream(openAiCtx *ctx, char *msg) {
+    struct termios *raw = &cli_stream_raw_termios;
+    int watching = 0;
+
+    if (isatty(STDIN_FILENO) &&
+        tcgetattr(STDIN_FILENO, &cli_stream_termios) != -1) {
+        *raw = cli_stream_termios;
+        /* Enter is read as linenoise reads it, so typeahead means the same */
+        raw->c_iflag &= ~ICRNL;
+        raw->c_lflag &= ~(ICANON | ECHO);
+        raw->c_cc[VMIN] = 1;
+        raw->c_cc[VTIME] = 0;
+        raw->c_cc[VINTR] = _POSIX_VDISABLE;
+        cliStreamSignalsWatch();
+        watching = 1;
+        if (tcsetattr(STDIN_FILENO, TCSANOW, raw) != -1) {
+            cli_stream_raw = 1;
+            httpLoopWatch(ctx->loop, STDIN_FILENO, cliStreamKey, ctx);
+        }
+    }
+
+    openAiChatStream(ctx, msg);
+
+    httpLoopWatch(ctx->loop, -1, NULL, NULL);
+    cliStreamRestoreTerminal();
+    if (watching) {
+        cliStreamSignalsUnwatch();
+    }
+}
+
 static void commandChat(openAiCtx *ctx, char *line) {
     ssize_t len = 0;
     json *resp, *sel;
 
     if (ctx->flags & OPEN_AI_FLAG_STREAM) {
-        openAiChatStream(ctx, line);
+        cliChatStream(ctx, line);
     } else {
         resp = openAiChat(ctx, line);
         sel = jsonSelect(resp, ".choices[0].message.content:s");
 
         if (sel) {
+            /* History is kept escaped */
             len = strlen(sel->str);
+            aoStr *reply = aoStrDupRaw(sel->str, len, len);
             openAiChatHistoryAppend(ctx, OPEN_AI_ROLE_ASSISTANT, NULL,
-                                    aoStrDupRaw(sel->str, len, len));
+                                    aoStrEscapeString(reply));
+            aoStrRelease(reply);
         }
         jsonRelease(resp);
     }
@@ -170,7 +350,6 @@ static void commandSave(openAiCtx *ctx, char *line) {
     if (ctx->chat_id == 0) {
         openAiCtxDbInit(ctx);
         openAiCtxDbNewChat(ctx);
-        openAiCtxDbSaveHistory(ctx);
     }
     openAiCtxDbSaveHistory(ctx);
 }
@@ -273,7 +452,7 @@ static void commandChatFile(openAiCtx *ctx, char *line) {
     }
 
     aoStrCatPrintf(cmdbuffer, "%s : \n ```\n%s\n```", cmd, file_contents->data);
-    openAiChatStream(ctx, cmdbuffer->data);
+    cliChatStream(ctx, cmdbuffer->data);
     aoStrRelease(file_contents);
     aoStrRelease(cmdbuffer);
 }
@@ -303,6 +482,25 @@ static void commandChatList(openAiCtx *ctx, char *line) {
     }
 }
 
+static void commandSearch(openAiCtx *ctx, char *line) {
+    list *lines, *node;
+
+    if (!isspace(*line)) {
+        prompt_warning("Usage: /search <words>\n");
+        return;
+    }
+    if ((lines = openAiCtxDbSearch(ctx, line, OPEN_AI_SEARCH_LIMIT)) == NULL) {
+        return;
+    }
+    if (lines->next == lines) {
+        printf("No matches\n");
+    }
+    for (node = lines->next; node != lines; node = node->next) {
+        printf("%s\n", ((aoStr *)node->value)->data);
+    }
+    listRelease(lines, (void (*)(void *))aoStrRelease);
+}
+
 static void commandChatDel(openAiCtx *ctx, char *line) {
     int id = 0;
     char *ptr = line;
@@ -380,6 +578,9 @@ static void commandChatLoad(openAiCtx *ctx, char *line) {
 static void commandChatHistoryList(openAiCtx *ctx, char *line) {
     (void)line;
     printf("messages: %d\n", ctx->chat_len);
+    printf("tokens: %zu, sending %zu of a %zu budget\n",
+           openAiCtxHistoryTokens(ctx), openAiCtxSentTokens(ctx),
+           openAiCtxHistoryBudget(ctx));
     openAiCtxHistoryPrint(ctx);
 }
 
@@ -427,6 +628,9 @@ static void commandExit(openAiCtx *ctx, char *line) {
     if (ctx->flags & OPEN_AI_FLAG_PERSIST) {
         commandSave(ctx, line);
     }
+    /* exit() does not wait for the writer thread */
+    openAiCtxDbClose(ctx);
+    curlHttpCleanup();
     fprintf(stderr, "Good bye!\n");
     exit(EXIT_SUCCESS);
 }
@@ -454,6 +658,8 @@ static void commandHelp(openAiCtx *ctx, char *line) {
     fprintf(stderr, "  chat-del <id> - Delete a chat from database\n");
     fprintf(stderr,
             "  chat-rename <id> <name> - Rename a chat with id <id> to <name> in database\n");
+    fprintf(stderr,
+            "  search <words> - Find saved messages containing all of the words\n");
 
     fprintf(stderr, "\nSET OPTIONS: \n\n");
     fprintf(stderr,
@@ -465,6 +671,20 @@ static void commandHelp(openAiCtx *ctx, char *line) {
             "  set-presence-pen <float> - 2.0 - 2.0 Positives penalize tokens if they have already appeared in the text\n");
     fprintf(stderr,
             "  set-temperature <float> - 0.0 - 2.0 Higher values will make the output more random\n");
+    fprintf(stderr,
+            "  set-context <tokens> - Override the context window of the model, the oldest messages are not sent once the history outgrows it\n");
+    fprintf(stderr,
+            "  set-cache <ttl_seconds> [max_mb] - Answer repeated questions from the SQLite3 database for this long, 0 turns it off\n");
+    fprintf(stderr,
+            "  set-frame <ms> - Write streamed answers at most this often, 0 writes every token as it arrives\n");
+    fprintf(stderr,
+            "  set-markdown <1|0> - Style markdown in streamed answers, on by default for a terminal unless NO_COLOR is set\n");
+
+    fprintf(stderr, "\nKEYS: \n\n");
+    fprintf(stderr,
+            "  Ctrl-R - Search previous prompts, again for an older match, Ctrl-G to give up\n");
+    fprintf(stderr,
+            "  Ctrl-C or Esc - Stop an answer as it streams, what arrived is kept\n");
 
     fprintf(stderr, "\n");
     fprintf(stderr, "  exit - Exits program\n");
@@ -551,6 +771,77 @@ static void commandSetTemperature(openAiCtx *ctx, char *line) {
     }
 }
 
+static void commandSetContext(openAiCtx *ctx, char *line) {
+    char *ptr = line, *check;
+    long context_window = 0;
+    if (!isspace(*ptr)) {
+        warning("Usage: set-context <tokens>\n");
+        return;
+    }
+    ptr++;
+    context_window = strtol(ptr, &check, 10);
+    if (check == ptr || context_window <= 0) {
+        warning("Usage: set-context <tokens>\n");
+        return;
+    }
+    openAiCtxSetContextWindow(ctx, context_window);
+}
+
+static void commandSetFrame(openAiCtx *ctx, char *line) {
+    char *ptr = line, *check;
+    long frame_ms = 0;
+    if (!isspace(*ptr)) {
+        warning("Usage: set-frame <ms>\n");
+        return;
+    }
+    ptr++;
+    frame_ms = strtol(ptr, &check, 10);
+    if (check == ptr || frame_ms < 0) {
+        warning("Usage: set-frame <ms>\n");
+        return;
+    }
+    openAiCtxSetRenderFrame(ctx, frame_ms);
+}
+
+static void commandSetMarkdown(openAiCtx *ctx, char *line) {
+    char *ptr = line;
+
+    if (!isspace(*ptr)) {
+        warning("Usage: set-markdown <1|0>\n");
+        return;
+    }
+    ptr++;
+    if (*ptr == '1' || *ptr == '0') {
+        openAiCtxSetRenderMarkdown(ctx, *ptr == '1');
+    } else {
+        warning("set-markdown '%c' is invalid\n", *ptr);
+    }
+}
+
+static void commandSetCache(openAiCtx *ctx, char *line) {
+    char *ptr = line, *check;
+    long ttl = 0, max_mb = 0;
+    if (!isspace(*ptr)) {
+        warning("Usage: set-cache <ttl_seconds> [max_mb]\n");
+        return;
+    }
+    ptr++;
+    ttl = strtol(ptr, &check, 10);
+    if (check == ptr || ttl < 0) {
+        warning("Usage: set-cache <ttl_seconds> [max_mb]\n");
+        return;
+    }
+    ptr = check;
+    max_mb = strtol(ptr, &check, 10);
+    if (check == ptr) {
+        max_mb = ctx->cache_max / (1024 * 1024);
+    } else if (max_mb <= 0) {
+        warning("Usage: set-cache <ttl_seconds> [max_mb]\n");
+        return;
+    }
+    openAiCtxSetCache(ctx, ttl, max_mb * 1024 * 1024);
+}
+
 static char *cliHintsCallback(const char *buf, int *color, int *bold) {
     *color = 90;
     *bold = 0;
@@ -587,10 +878,15 @@ static void cliCompletionCallback(const char *buf, linenoiseCompletions *lc) {
 }
 
 static void cliInit(char *filepath) {
-    linenoiseHistoryLoad(filepath); /* Load the history at startup */
+    /* Load the history at startup, each line is then appended as it is
+     * entered */
+    linenoiseHistorySetMaxLen(CLI_HISTORY_MAX_LEN);
+    linenoiseHistoryOpen(filepath);
     linenoiseSetCompletionCallback(cliCompletionCallback);
     linenoiseSetHintsCallback(cliHintsCallback);
     linenoiseSetMultiLine(1);
+    /* Should the program exit half way through an answer */
+    atexit(cliStreamRestoreTerminal);
 }
 
 static dict *cliLoadCommands(void) {
@@ -624,6 +920,8 @@ void cliMain(openAiCtx *ctx) {
     cliInit(history_filepath->data);
 
     while (1) {
+        /* Saves that failed while the last answer streamed */
+        openAiCtxDbCheckWrites(ctx);
         line = linenoise(">>> ");
         cmd_len = 0;
         if (line == NULL) {
@@ -633,7 +931,6 @@ void cliMain(openAiCtx *ctx) {
 
         if (line[0] != '\0' && line[0] != '/') {
             linenoiseHistoryAdd(line);
-            linenoiseHistorySave(history_filepath->data);
             commandChat(ctx, line);
         } else if (line[0] != '\0' && line[0] == '/') {
             while (!isspace(*ptr) && *ptr != '\0') {
@@ -647,7 +944,6 @@ void cliMain(openAiCtx *ctx) {
             } else {
                 command->commandHandler(ctx, ptr);
                 linenoiseHistoryAdd(line);
-                linenoiseHistorySave(history_filepath->data);
             }
         }
         free(line);
@@ -13,6 +13,13 @@
 
 #define dictShouldResize(d) ((d)->size >= (d)->threashold)
 
+dictType default_table_type = {
+        .freeKey = free,
+        .freeValue = NULL, /* TODO: not a clue what the value is */
+        .keyCmp = dictStrCmp,
+        .hashFunction = dictGenericHashFunction,
+};
+
 size_t dictGenericHashFunction(void *key) {
     char *s = (char *)key;
     size_t h = (size_t)*s;
@@ -61,7 +68,7 @@ static dictNode *dictNodeNew(void *key, void *value) {
 void dictRelease(dict *d) {
     if (d) {
         dictNode *next = NULL;
-        for (size_t i = 0; i < d->size; ++i) {
+        for (size_t i = 0; i < d->capacity; ++i) {
             dictNode *n = d->body[i];
             while (n) {
                 next = n->next;
@@ -72,6 +79,7 @@ void dictRelease(dict *d) {
                 n = next;
             }
         }
+        free(d->body);
         free(d);
     }
 }
@@ -64,11 +64,6 @@ int dictStrCmp(void *s1, void *s2);
 int dictSet(dict *d, void *key, void *value);
 void dictSetOrReplace(dict *d, void *key, void *value);
 
-static dictType default_table_type = {
-        .freeKey = free,
-        .freeValue = NULL, /* TODO: not a clue what the value is */
-        .keyCmp = dictStrCmp,
-        .hashFunction = dictGenericHashFunction,
-};
+extern dictType default_table_type;
 
 #endif
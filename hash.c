@@ -0,0 +1,93 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define hashRotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t hashFmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * MurmurHash3_x64_128 by Austin Appleby, the 128 bit hash is written out as
+ * two little endian 64 bit words
+ */
+void hashMurmur3_128(const void *data, size_t len, uint32_t seed,
+                     unsigned char out[HASH_128_LEN]) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    const unsigned char *tail = bytes + (len & ~(size_t)15);
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed, k1, k2;
+
+    for (const unsigned char *p = bytes; p < tail; p += 16) {
+        /* memcpy as the data need not be aligned */
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+
+        k1 *= c1;
+        k1 = hashRotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = hashRotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2;
+        k2 = hashRotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = hashRotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    /* The last 0-15 bytes, bytes 8-15 go into k2 */
+    k1 = k2 = 0;
+    for (size_t i = 0; i < (len & 15); ++i) {
+        if (i < 8) {
+            k1 ^= (uint64_t)tail[i] << (i * 8);
+        } else {
+            k2 ^= (uint64_t)tail[i] << ((i - 8) * 8);
+        }
+    }
+    if ((len & 15) > 8) {
+        k2 *= c2;
+        k2 = hashRotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    if ((len & 15) > 0) {
+        k1 *= c1;
+        k1 = hashRotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = hashFmix64(h1);
+    h2 = hashFmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (h1 >> (i * 8)) & 0xFF;
+        out[i + 8] = (h2 >> (i * 8)) & 0xFF;
+    }
+}
@@ -0,0 +1,18 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_128_LEN (16)
+
+void hashMurmur3_128(const void *data, size_t len, uint32_t seed,
+                     unsigned char out[HASH_128_LEN]);
+
+#endif
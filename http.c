@@ -12,8 +12,10 @@
 #include "aostr.h"
 #include "http.h"
 #include "json.h"
+#include "list.h"
 #include "openai.h"
 #include "panic.h"
+#include "sse.h"
 
 static httpResponse *httpResponseNew(void) {
     httpResponse *res;
@@ -22,7 +24,9 @@ static httpResponse *httpResponseNew(void) {
         return NULL;
 
     res->body = NULL;
+    res->parsed = NULL;
     res->bodylen = 0;
+    res->content_type = RES_TYPE_INVALID;
     /* Start in error state */
     res->status_code = 404;
 
@@ -32,6 +36,7 @@ static httpResponse *httpResponseNew(void) {
 void httpResponseRelease(httpResponse *response) {
     if (response) {
         aoStrRelease(response->body);
+        jsonRelease(response->parsed);
         free(response);
     }
 }
@@ -39,6 +44,8 @@ void httpResponseRelease(httpResponse *response) {
 static int _httpGetContentType(char *type) {
     if (strncasecmp(type, "application/json", 16) == 0)
         return RES_TYPE_JSON;
+    if (strncasecmp(type, "text/event-stream", 17) == 0)
+        return RES_TYPE_EVENT_STREAM;
     if (strncasecmp(type, "text/html", 9) == 0)
         return RES_TYPE_HTML;
     if (strncasecmp(type, "text", 4) == 0)
@@ -68,6 +75,9 @@ void httpPrintResponse(httpResponse *response) {
     case RES_TYPE_TEXT:
         content_type = "text";
         break;
+    case RES_TYPE_EVENT_STREAM:
+        content_type = "event-stream";
+        break;
     }
 
     printf("status code: %d\n"
@@ -78,26 +88,145 @@ void httpPrintResponse(httpResponse *response) {
            response->body->data);
 }
 
-static size_t httpRequestWriteCallback(char *ptr, size_t size, size_t nmemb,
-                                       void **userdata) {
-    aoStr **str = (aoStr **)userdata;
-    size_t rbytes = size * nmemb;
-    aoStrCatLen(*str, ptr, rbytes);
-    return rbytes;
+/* Used by the blocking wrappers */
+static httpLoop *http_default_loop = NULL;
+
+/* Idle easy handles for a single scheme+host+port, handing out a handle that
+ * has already talked to the host lets libcurl reuse the live connection */
+typedef struct httpPoolEntry {
+    aoStr *key;
+    list *idle;
+    int idle_count;
+} httpPoolEntry;
+
+typedef struct httpPool {
+    CURLSH *share; /* DNS, TLS session and connection cache */
+    list *entries;
+} httpPool;
+
+static httpPool *http_pool = NULL;
+
+static httpPool *httpPoolGet(void) {
+    if (http_pool) {
+        return http_pool;
+    }
+
+    if ((http_pool = malloc(sizeof(httpPool))) == NULL) {
+        panic("OOM creating http pool\n");
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    http_pool->share = curl_share_init();
+    curl_share_setopt(http_pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(http_pool->share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(http_pool->share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_CONNECT);
+    http_pool->entries = listNew();
+    return http_pool;
 }
 
-#define HTTP_REQ_GET  0
-#define HTTP_REQ_POST 1
+/* Connections can only be reused for the same scheme, host and port so that
+ * is what the pool is keyed on e.g: 'https://api.openai.com:443' */
+static aoStr *httpPoolKey(char *url) {
+    CURLU *handle = curl_url();
+    char *scheme = NULL, *host = NULL, *port = NULL;
+    aoStr *key = aoStrAlloc(128);
 
-static httpResponse *curlMakeRequest(char *url, int req_type, list *headers,
-                                     aoStr *payload, int flags) {
+    if (handle && curl_url_set(handle, CURLUPART_URL, url, 0) == CURLUE_OK) {
+        curl_url_get(handle, CURLUPART_SCHEME, &scheme, 0);
+        curl_url_get(handle, CURLUPART_HOST, &host, 0);
+        curl_url_get(handle, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT);
+    }
+
+    if (scheme && host && port) {
+        aoStrCatPrintf(key, "%s://%s:%s", scheme, host, port);
+    } else {
+        aoStrCat(key, url);
+    }
+
+    curl_free(scheme);
+    curl_free(host);
+    curl_free(port);
+    curl_url_cleanup(handle);
+    return key;
+}
+
+static httpPoolEntry *httpPoolGetEntry(httpPool *pool, aoStr *key) {
+    httpPoolEntry *entry;
+    list *node = pool->entries->next;
+
+    while (node != pool->entries) {
+        entry = node->value;
+        if (entry->key->len == key->len && !aoStrCmp(entry->key, key)) {
+            return entry;
+        }
+        node = node->next;
+    }
+
+    entry = malloc(sizeof(httpPoolEntry));
+    entry->key = aoStrDup(key);
+    entry->idle = listNew();
+    entry->idle_count = 0;
+    listAppend(pool->entries, entry);
+    return entry;
+}
+
+/* Get a handle for `key` from the pool, the most recently returned handle is
+ * handed out first as it is the most likely to still have a live connection */
+static CURL *httpPoolAcquire(aoStr *key) {
+    httpPool *pool = httpPoolGet();
+    httpPoolEntry *entry = httpPoolGetEntry(pool, key);
     CURL *curl;
-    CURLcode res;
-    httpResponse *httpres;
-    char *contenttype = NULL;
-    aoStr *respbody = aoStrAlloc(512);
-    long http_code = 0;
 
+    if ((curl = listPop(entry->idle)) != NULL) {
+        entry->idle_count--;
+        /* Keeps live connections and caches, drops all options */
+        curl_easy_reset(curl);
+    } else if ((curl = curl_easy_init()) == NULL) {
+        return NULL;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_SHARE, pool->share);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    return curl;
+}
+
+static void httpPoolRelease(aoStr *key, CURL *curl) {
+    httpPool *pool = httpPoolGet();
+    httpPoolEntry *entry = httpPoolGetEntry(pool, key);
+
+    if (entry->idle_count >= HTTP_POOL_MAX_IDLE) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    listAppend(entry->idle, curl);
+    entry->idle_count++;
+}
+
+static void httpPoolEntryRelease(void *_entry) {
+    httpPoolEntry *entry = (httpPoolEntry *)_entry;
+    listRelease(entry->idle, (void (*)(void *))curl_easy_cleanup);
+    aoStrRelease(entry->key);
+    free(entry);
+}
+
+/* Close all pooled connections, a subsequent request will create a new pool */
+void curlHttpCleanup(void) {
+    if (http_default_loop) {
+        httpLoopRelease(http_default_loop);
+        http_default_loop = NULL;
+    }
+    if (http_pool) {
+        listRelease(http_pool->entries, httpPoolEntryRelease);
+        curl_share_cleanup(http_pool->share);
+        free(http_pool);
+        http_pool = NULL;
+        curl_global_cleanup();
+    }
+}
+
+static struct curl_slist *httpBuildHeaders(list *headers) {
     struct curl_slist *curl_headers = NULL;
     curl_headers = curl_slist_append(curl_headers,
                                      "Content-Type: application/json");
@@ -109,127 +238,419 @@ static httpResponse *curlMakeRequest(char *url, int req_type, list *headers,
             node = node->next;
         }
     }
+    return curl_headers;
+}
 
-    if ((httpres = httpResponseNew()) == NULL) {
-        return NULL;
-    }
+/*=============================================================================
+ * Requests
+ *============================================================================*/
+
+static size_t httpRequestWriteCallback(char *ptr, size_t size, size_t nmemb,
+                                       void *userdata) {
+    httpRequest *req = (httpRequest *)userdata;
+    size_t rbytes = size * nmemb;
 
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        if (req_type == HTTP_REQ_POST && payload) {
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload->data);
+    if (req->sse || req->json_parser) {
+        /* Headers have all arrived by the time the body does */
+        if (req->response->content_type == RES_TYPE_INVALID) {
+            char *contenttype = NULL;
+            curl_easy_getinfo(req->curl, CURLINFO_CONTENT_TYPE, &contenttype);
+            if (contenttype) {
+                req->response->content_type = _httpGetContentType(contenttype);
+            }
         }
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, httpRequestWriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &respbody);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, curl_headers);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-        if (flags & OPEN_AI_FLAG_VERBOSE) {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+        /* Anything else, typically an error, is kept on the response */
+        if (req->sse &&
+            req->response->content_type == RES_TYPE_EVENT_STREAM) {
+            req->response->bodylen += rbytes;
+            return sseParserFeed(req->sse, ptr, rbytes) ? rbytes : 0;
+        } else if (req->json_parser &&
+                   req->response->content_type == RES_TYPE_JSON) {
+            /* A parse error is reported by the tree once the transfer is
+             * over */
+            req->response->bodylen += rbytes;
+            jsonPushParserFeed(req->json_parser, ptr, rbytes);
+            return rbytes;
         }
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-
-        if (res != CURLE_OK) {
-            aoStrRelease(respbody);
-            warning("Failed to make request: %s\n", curl_easy_strerror(res));
-            return NULL;
-        } else {
-            res = curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &contenttype);
-            httpres->status_code = http_code;
-            httpres->content_type = _httpGetContentType(contenttype);
-            httpres->body = respbody;
-            httpres->bodylen = respbody->len;
-
-            if (httpres->status_code == 200 &&
-                httpres->content_type == RES_TYPE_JSON) {
-                curl_easy_cleanup(curl);
-                curl_slist_free_all(curl_headers);
-                return httpres;
-            }
+    } else if (req->on_data) {
+        return req->on_data(req, ptr, rbytes);
+    }
+    aoStrCatLen(req->response->body, ptr, rbytes);
+    return rbytes;
+}
+
+/* Called by libcurl as the transfer progresses, which is every time the loop
+ * moves it along, returning non-zero aborts it */
+static int httpRequestProgressCallback(void *userdata, curl_off_t dltotal,
+                                       curl_off_t dlnow, curl_off_t ultotal,
+                                       curl_off_t ulnow) {
+    httpRequest *req = (httpRequest *)userdata;
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return req->cancelled;
+}
+
+/* Create a request ready to be submitted to a loop, nothing is sent until it
+ * is. The payload is copied so can be released as soon as this returns */
+httpRequest *httpRequestNew(char *url, int method, list *headers,
+                            aoStr *payload, int flags) {
+    httpRequest *req;
+
+    if ((req = malloc(sizeof(httpRequest))) == NULL) {
+        return NULL;
+    }
+
+    req->pool_key = httpPoolKey(url);
+    if ((req->curl = httpPoolAcquire(req->pool_key)) == NULL) {
+        aoStrRelease(req->pool_key);
+        free(req);
+        return NULL;
+    }
+
+    req->response = httpResponseNew();
+    req->response->body = aoStrAlloc(512);
+    req->headers = httpBuildHeaders(headers);
+    req->loop = NULL;
+    req->result = CURLE_OK;
+    req->flags = flags;
+    req->done = 0;
+    req->cancelled = 0;
+    req->on_data = NULL;
+    req->sse = NULL;
+    req->json_parser = NULL;
+    req->on_complete = NULL;
+    req->privdata = NULL;
+
+    curl_easy_setopt(req->curl, CURLOPT_URL, url);
+    if (method == HTTP_REQ_POST && payload) {
+        curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)payload->len);
+        curl_easy_setopt(req->curl, CURLOPT_COPYPOSTFIELDS, payload->data);
+    }
+    curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION,
+                     httpRequestWriteCallback);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, req);
+    curl_easy_setopt(req->curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(req->curl, CURLOPT_XFERINFOFUNCTION,
+                     httpRequestProgressCallback);
+    curl_easy_setopt(req->curl, CURLOPT_XFERINFODATA, req);
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    if (flags & OPEN_AI_FLAG_VERBOSE) {
+        curl_easy_setopt(req->curl, CURLOPT_VERBOSE, 1L);
+    }
+    return req;
+}
+
+/* `on_data` receives the body as it arrives instead of it being accumulated
+ * on the response, `on_complete` is called once the transfer is over */
+void httpRequestSetCallbacks(httpRequest *req, httpDataCallback *on_data,
+                             httpCompleteCallback *on_complete,
+                             void *privdata) {
+    req->on_data = on_data;
+    req->on_complete = on_complete;
+    req->privdata = privdata;
+}
+
+/* The body is `text/event-stream`, `on_event` is called with each complete
+ * event. Should the server respond with anything else the body is accumulated
+ * on the response as normal */
+void httpRequestSetStream(httpRequest *req, sseEventCallback *on_event,
+                          httpCompleteCallback *on_complete, void *privdata) {
+    if (req->sse) {
+        sseParserRelease(req->sse);
+    }
+    req->sse = sseParserNew(on_event, privdata);
+    req->on_data = NULL;
+    req->on_complete = on_complete;
+    req->privdata = privdata;
+}
+
+/* The body is `application/json` and is parsed as it arrives rather than
+ * being accumulated first, the tree is left on `response->parsed`. Should the
+ * server respond with anything else the body is accumulated on the response
+ * as normal */
+void httpRequestSetJSON(httpRequest *req, httpCompleteCallback *on_complete,
+                        void *privdata) {
+    if (req->json_parser) {
+        jsonPushParserRelease(req->json_parser);
+    }
+    req->json_parser = jsonPushParserNew(JSON_NO_FLAGS);
+    req->on_data = NULL;
+    req->on_complete = on_complete;
+    req->privdata = privdata;
+}
+
+/* Releasing an in flight request cancels it */
+void httpRequestRelease(httpRequest *req) {
+    if (req) {
+        if (req->loop && !req->done) {
+            curl_multi_remove_handle(req->loop->multi, req->curl);
+            req->loop->in_flight--;
         }
+        httpPoolRelease(req->pool_key, req->curl);
+        curl_slist_free_all(req->headers);
+        sseParserRelease(req->sse);
+        jsonPushParserRelease(req->json_parser);
+        aoStrRelease(req->pool_key);
+        httpResponseRelease(req->response);
+        free(req);
+    }
+}
 
-        curl_easy_cleanup(curl);
+/* Abort the transfer the next time the loop moves it along, it then
+ * completes as normal with `result` set to CURLE_ABORTED_BY_CALLBACK. Unlike
+ * releasing it whatever arrived before the cancel is still there to look at
+ * in `on_complete` */
+void httpRequestCancel(httpRequest *req) {
+    if (req && !req->done) {
+        req->cancelled = 1;
     }
+}
 
-    curl_slist_free_all(curl_headers);
-    return NULL;
+/* Did the transfer complete with a 2xx */
+int httpRequestOk(httpRequest *req) {
+    return req->done && req->result == CURLE_OK &&
+            req->response->status_code >= 200 &&
+            req->response->status_code < 300;
 }
 
-/* This is a bit nuts, it streams data from an endpoint repeaditly calling the
- * `callback` with `privdata`, there is no point in accumulating all of the
- * data and returning it as it is too slow. However the stream is fast */
-int curlHttpStreamPost(char *url, list *headers, aoStr *payload,
-                       void **privdata, httpStreamCallBack *callback,
-                       int flags) {
-    CURL *curl;
-    CURLcode res;
+static void httpRequestFinish(httpRequest *req, CURLcode result) {
     long http_code = 0;
+    char *contenttype = NULL;
 
-    struct curl_slist *curl_headers = NULL;
-    curl_headers = curl_slist_append(curl_headers,
-                                     "Content-Type: application/json");
-    if (headers) {
-        list *node = headers->next;
-        while (node != headers) {
-            curl_headers = curl_slist_append(curl_headers,
-                                             aoStrGetData(node->value));
-            node = node->next;
-        }
+    req->done = 1;
+    req->result = result;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(req->curl, CURLINFO_CONTENT_TYPE, &contenttype);
+    req->response->status_code = http_code;
+    req->response->content_type = contenttype ?
+            _httpGetContentType(contenttype) :
+            RES_TYPE_INVALID;
+    /* Anything that was not parsed as it arrived */
+    req->response->bodylen += req->response->body->len;
+
+    /* A final event not followed by a blank line */
+    if (req->sse && result == CURLE_OK &&
+        req->response->content_type == RES_TYPE_EVENT_STREAM) {
+        sseParserFinish(req->sse);
+    }
+
+    if (req->json_parser && result == CURLE_OK &&
+        req->response->content_type == RES_TYPE_JSON) {
+        req->response->parsed = jsonPushParserFinish(req->json_parser);
+    }
+
+    if (result != CURLE_OK && !req->cancelled) {
+        warning("Failed to make request: %s\n", curl_easy_strerror(result));
+    }
+}
+
+/*=============================================================================
+ * Event loop, drives any number of requests concurrently on one thread
+ *============================================================================*/
+
+httpLoop *httpLoopNew(void) {
+    httpLoop *loop;
+
+    if ((loop = malloc(sizeof(httpLoop))) == NULL) {
+        return NULL;
+    }
+    /* Make sure curl_global_init() has happened */
+    httpPoolGet();
+    loop->multi = curl_multi_init();
+    loop->in_flight = 0;
+    loop->watch_fd = -1;
+    loop->on_watch = NULL;
+    loop->watch_privdata = NULL;
+    return loop;
+}
+
+/* In flight requests are not released, they belong to whoever submitted
+ * them */
+void httpLoopRelease(httpLoop *loop) {
+    if (loop) {
+        curl_multi_cleanup(loop->multi);
+        free(loop);
+    }
+}
+
+int httpLoopSubmit(httpLoop *loop, httpRequest *req) {
+    if (curl_multi_add_handle(loop->multi, req->curl) != CURLM_OK) {
+        return HTTP_ERR;
     }
+    req->loop = loop;
+    req->done = 0;
+    loop->in_flight++;
+    return HTTP_OK;
+}
+
+/* Have the loop wake up when `fd` is readable and call `on_watch`, for as
+ * long as there are requests in flight. Only one fd is watched at a time, -1
+ * stops watching */
+void httpLoopWatch(httpLoop *loop, int fd, httpWatchCallback *on_watch,
+                   void *privdata) {
+    loop->watch_fd = on_watch ? fd : -1;
+    loop->on_watch = on_watch;
+    loop->watch_privdata = privdata;
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload->data);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, privdata);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, curl_headers);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-        if (flags & OPEN_AI_FLAG_VERBOSE) {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+/* Wait up to `timeout_ms` for activity on any of the transfers or the watched
+ * fd, move them all along and call `on_complete` for those that finished.
+ * Returns how many requests are still in flight */
+int httpLoopRunOnce(httpLoop *loop, int timeout_ms) {
+    int running = 0, numfds = 0, queued = 0, extra = 0;
+    struct curl_waitfd watch;
+    CURLMsg *msg;
+    CURLMcode mc;
+    httpRequest *req;
+
+    if (loop->in_flight == 0) {
+        return 0;
+    }
+
+    if (loop->watch_fd != -1) {
+        watch.fd = loop->watch_fd;
+        watch.events = CURL_WAIT_POLLIN;
+        watch.revents = 0;
+        extra = 1;
+    }
+
+    if ((mc = curl_multi_poll(loop->multi, extra ? &watch : NULL, extra,
+                              timeout_ms, &numfds)) != CURLM_OK) {
+        warning("curl_multi_poll: %s\n", curl_multi_strerror(mc));
+    }
+    /* Before the transfers move, so a cancel takes effect straight away */
+    if (extra && watch.revents && loop->on_watch) {
+        loop->on_watch(loop, watch.fd, loop->watch_privdata);
+    }
+    curl_multi_perform(loop->multi, &running);
+
+    while ((msg = curl_multi_info_read(loop->multi, &queued)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
         }
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        req = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+        httpRequestFinish(req, msg->data.result);
+        curl_multi_remove_handle(loop->multi, msg->easy_handle);
+        loop->in_flight--;
 
-        if (res != CURLE_OK) {
-            warning("Failed to make request: %s\n", curl_easy_strerror(res));
+        if (req->on_complete) {
+            /* May well release the request */
+            req->on_complete(req);
         }
+    }
 
-        curl_easy_cleanup(curl);
+    return loop->in_flight;
+}
+
+/* Run until every submitted request has completed */
+void httpLoopRun(httpLoop *loop) {
+    while (httpLoopRunOnce(loop, HTTP_LOOP_POLL_MS))
+        ;
+}
+
+/* Run until `req` has completed, other requests on the loop progress as
+ * well. `req` must not be released by its `on_complete` callback */
+void httpLoopWait(httpLoop *loop, httpRequest *req) {
+    while (!req->done && httpLoopRunOnce(loop, HTTP_LOOP_POLL_MS))
+        ;
+}
+
+/*=============================================================================
+ * Blocking API
+ *============================================================================*/
+
+static httpLoop *httpDefaultLoop(void) {
+    if (http_default_loop == NULL) {
+        http_default_loop = httpLoopNew();
     }
+    return http_default_loop;
+}
+
+static httpResponse *curlMakeRequest(char *url, int req_type, list *headers,
+                                     aoStr *payload, int flags,
+                                     int parse_json) {
+    httpLoop *loop = httpDefaultLoop();
+    httpResponse *httpres = NULL;
+    httpRequest *req;
 
-    curl_slist_free_all(curl_headers);
-    return http_code >= 200 && http_code <= 300;
+    if ((req = httpRequestNew(url, req_type, headers, payload, flags)) ==
+        NULL) {
+        return NULL;
+    }
+    if (parse_json) {
+        httpRequestSetJSON(req, NULL, NULL);
+    }
+
+    if (httpLoopSubmit(loop, req) == HTTP_OK) {
+        httpLoopWait(loop, req);
+        if (req->result == CURLE_OK && req->response->status_code == 200 &&
+            req->response->content_type == RES_TYPE_JSON) {
+            /* Steal the response */
+            httpres = req->response;
+            req->response = NULL;
+        }
+    }
+
+    httpRequestRelease(req);
+    return httpres;
+}
+
+/* Streams server-sent events from an endpoint calling `callback` with
+ * `privdata` for each event, there is no point in accumulating all of the
+ * data and returning it as it is too slow. However the stream is fast */
+int curlHttpStreamPost(char *url, list *headers, aoStr *payload,
+                       void *privdata, sseEventCallback *callback, int flags) {
+    httpLoop *loop = httpDefaultLoop();
+    httpRequest *req;
+    int ok = 0;
+
+    if ((req = httpRequestNew(url, HTTP_REQ_POST, headers, payload, flags)) ==
+        NULL) {
+        return 0;
+    }
+    httpRequestSetStream(req, callback, NULL, privdata);
+
+    if (httpLoopSubmit(loop, req) == HTTP_OK) {
+        httpLoopWait(loop, req);
+        ok = httpRequestOk(req);
+    }
+
+    httpRequestRelease(req);
+    return ok;
 }
 
 httpResponse *curlHttpGet(char *url, list *headers, int flags) {
-    return curlMakeRequest(url, HTTP_REQ_GET, headers, NULL, flags);
+    return curlMakeRequest(url, HTTP_REQ_GET, headers, NULL, flags, 0);
 }
 
 httpResponse *curlHttpPost(char *url, list *headers, aoStr *payload,
                            int flags) {
-    return curlMakeRequest(url, HTTP_REQ_POST, headers, payload, flags);
+    return curlMakeRequest(url, HTTP_REQ_POST, headers, payload, flags, 0);
 }
 
-json *curlHttpGetJSON(char *url, list *headers, int flags) {
-    httpResponse *response = curlHttpGet(url, headers, flags);
-    if (response && response->status_code == 200 &&
-        response->content_type == RES_TYPE_JSON) {
-        json *j = jsonParseWithLen(response->body->data, response->bodylen);
-        return j;
+/* Only a 200 with a json body is returned, the response is stolen from */
+static json *curlTakeJSON(httpResponse *response) {
+    json *j = NULL;
+    if (response) {
+        j = response->parsed;
+        response->parsed = NULL;
+        httpResponseRelease(response);
     }
-    httpResponseRelease(response);
-    return NULL;
+    return j;
+}
+
+json *curlHttpGetJSON(char *url, list *headers, int flags) {
+    return curlTakeJSON(
+            curlMakeRequest(url, HTTP_REQ_GET, headers, NULL, flags, 1));
 }
 
 json *curlHttpPostJSON(char *url, list *headers, aoStr *payload, int flags) {
-    httpResponse *response = curlHttpPost(url, headers, payload, flags);
-    if (response && response->status_code == 200 &&
-        response->content_type == RES_TYPE_JSON) {
-        json *j = jsonParseWithLen(response->body->data, response->bodylen);
-        return j;
-    }
-    httpResponseRelease(response);
-    return NULL;
+    return curlTakeJSON(
+            curlMakeRequest(url, HTTP_REQ_POST, headers, payload, flags, 1));
 }
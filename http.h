@@ -1,38 +1,108 @@
 #ifndef __HTTP__
 #define __HTTP__
 
+#include <curl/curl.h>
+
 #include "aostr.h"
 #include "list.h"
 #include "json.h"
+#include "sse.h"
 
 #define RES_TYPE_INVALID (0 << 1)
 #define RES_TYPE_HTML    (1 << 1)
 #define RES_TYPE_TEXT    (2 << 1)
 #define RES_TYPE_JSON    (3 << 1)
+#define RES_TYPE_EVENT_STREAM (4 << 1)
 
 #define HTTP_ERR 0
 #define HTTP_OK  1
 
-typedef size_t httpStreamCallBack(char *stream, size_t size, size_t nmemb,
-                                  void **userdata);
+#define HTTP_REQ_GET  0
+#define HTTP_REQ_POST 1
+
+/* Maximum number of idle handles kept alive per scheme+host+port */
+#define HTTP_POOL_MAX_IDLE (4)
+/* Longest a blocking wait sleeps in poll before checking again */
+#define HTTP_LOOP_POLL_MS (1000)
 
 typedef struct httpResponse {
-    aoStr *body;
+    aoStr *body;   /* Empty if the body was parsed as it arrived */
+    json *parsed;  /* Only for `httpRequestSetJSON` requests */
     unsigned int bodylen;
     unsigned int status_code;
     int content_type;
 } httpResponse;
 
+typedef struct httpLoop httpLoop;
+typedef struct httpRequest httpRequest;
+
+/* Called with each chunk of the response body as it arrives, returning
+ * anything other than `len` aborts the transfer */
+typedef size_t httpDataCallback(httpRequest *req, char *data, size_t len);
+/* Called once the transfer is over, check `result` and the response */
+typedef void httpCompleteCallback(httpRequest *req);
+/* Called by the loop when the fd it is watching has something to read */
+typedef void httpWatchCallback(httpLoop *loop, int fd, void *privdata);
+
+typedef struct httpRequest {
+    CURL *curl;
+    aoStr *pool_key;             /* scheme://host:port the handle is from */
+    struct curl_slist *headers;
+    httpLoop *loop;              /* Loop the request was submitted to */
+    httpResponse *response;      /* Body is only filled without `on_data` */
+    CURLcode result;
+    int flags;
+    int done;
+    int cancelled;               /* Aborted by `httpRequestCancel` */
+    httpDataCallback *on_data;
+    sseParser *sse;              /* Set for `text/event-stream` requests */
+    jsonPushParser *json_parser; /* Set for `application/json` requests */
+    httpCompleteCallback *on_complete;
+    void *privdata;
+} httpRequest;
+
+typedef struct httpLoop {
+    CURLM *multi;
+    int in_flight;
+    int watch_fd; /* Polled along with the transfers, -1 if there is none */
+    httpWatchCallback *on_watch;
+    void *watch_privdata;
+} httpLoop;
+
 void httpResponseRelease(httpResponse *response);
 void httpPrintResponse(httpResponse *response);
 
+httpRequest *httpRequestNew(char *url, int method, list *headers,
+                            aoStr *payload, int flags);
+void httpRequestSetCallbacks(httpRequest *req, httpDataCallback *on_data,
+                             httpCompleteCallback *on_complete,
+                             void *privdata);
+void httpRequestSetStream(httpRequest *req, sseEventCallback *on_event,
+                          httpCompleteCallback *on_complete, void *privdata);
+void httpRequestSetJSON(httpRequest *req, httpCompleteCallback *on_complete,
+                        void *privdata);
+void httpRequestRelease(httpRequest *req);
+void httpRequestCancel(httpRequest *req);
+int httpRequestOk(httpRequest *req);
+
+httpLoop *httpLoopNew(void);
+void httpLoopRelease(httpLoop *loop);
+int httpLoopSubmit(httpLoop *loop, httpRequest *req);
+void httpLoopWatch(httpLoop *loop, int fd, httpWatchCallback *on_watch,
+                   void *privdata);
+int httpLoopRunOnce(httpLoop *loop, int timeout_ms);
+void httpLoopRun(httpLoop *loop);
+void httpLoopWait(httpLoop *loop, httpRequest *req);
+
+/* Blocking API */
+
 httpResponse *curlHttpGet(char *url, list *headers, int flags);
 httpResponse *curlHttpPost(char *url, list *headers, aoStr *payload, int flags);
 json *curlHttpGetJSON(char *url, list *headers, int flags);
 json *curlHttpPostJSON(char *url, list *headers, aoStr *payload,
                        int flags);
 int curlHttpStreamPost(char *url, list *headers, aoStr *payload,
-                       void **privdata, httpStreamCallBack *callback,
-                       int flags);
+                       void *privdata, sseEventCallback *callback, int flags);
+void curlHttpCleanup(void);
 
 #endif
@@ -38,7 +38,7 @@ aoStr *ioReadFile(char *path) {
     }
     lseek(fd, 0, SEEK_SET);
 
-    buffer = malloc(sizeof(char) * len);
+    buffer = malloc(sizeof(char) * (len + 1));
 
     if (buffer == NULL) {
         warning("Possible OOM: %s\n", strerror(errno));
@@ -19,11 +19,29 @@
 #define JSON_SEL_TYPECHECK (3)
 #define JSON_SEL_MAX_BUF   (256)
 
+/* One step of a compiled selector */
+typedef struct jsonSelectorOp {
+    int type;       /* JSON_SEL_OBJ, JSON_SEL_ARRAY or JSON_SEL_TYPECHECK */
+    int wildcard;   /* Index or part of the key is supplied at select time */
+    int idx;        /* Array index */
+    char check;     /* Type to check for */
+    char *key;      /* Object key, with a wildcard the text either side of the
+                     * '*' */
+    int key_len;
+    int prefix_len; /* Length of the key before the '*' */
+} jsonSelectorOp;
+
+struct jsonSelector {
+    int len;
+    jsonSelectorOp *ops;
+    char *keys; /* Storage for every key */
+};
+
 /**
  * Get item from an array of json or return null
  */
 json *jsonArrayAt(json *j, int idx) {
-    if (!jsonIsArray(j) && idx < 0) {
+    if (!jsonIsArray(j) || idx < 0) {
         return NULL;
     }
 
@@ -233,7 +251,7 @@ json *jsonSelect(json *j, const char *fmt, ...) {
                     goto fail;
                 }
 
-                memcpy(path + path_len, buf, len);
+                memcpy(path + path_len, s, len);
                 path_len += len;
                 ptr++;
                 continue;
@@ -265,3 +283,249 @@ fail:
     va_end(ap);
     return NULL;
 }
+
+/**
+ * Parse a selector as accepted by `jsonSelect` once so it can be used any
+ * number of times with `jsonSelectCompiled`:
+ *
+ * jsonSelector *sel = jsonSelectorCompile(".choices[*].delta.content:s");
+ * json *content = jsonSelectCompiled(J, sel, 0);
+ *
+ * Wildcards are still bound when selecting. Returns NULL if the selector is
+ * invalid, free with `jsonSelectorRelease`.
+ */
+jsonSelector *jsonSelectorCompile(const char *fmt) {
+    const char *ptr = fmt, *start;
+    char *end, *keys;
+    size_t fmt_len = strlen(fmt);
+    int count = 0, len;
+    jsonSelector *sel;
+    jsonSelectorOp *op;
+
+    if (*ptr != '.' && *ptr != '[') {
+        return NULL;
+    }
+
+    /* Upper bound on the number of ops */
+    for (; *ptr; ++ptr) {
+        if (*ptr == '.' || *ptr == '[' || *ptr == ':') {
+            count++;
+        }
+    }
+
+    sel = malloc(sizeof(jsonSelector));
+    sel->len = 0;
+    sel->ops = malloc(sizeof(jsonSelectorOp) * count);
+    sel->keys = keys = malloc(fmt_len + 1);
+
+    ptr = fmt;
+    while (*ptr) {
+        op = &sel->ops[sel->len];
+        op->wildcard = 0;
+        op->idx = 0;
+        op->check = '\0';
+        op->key = NULL;
+        op->key_len = 0;
+        op->prefix_len = 0;
+
+        switch (*ptr++) {
+        case '.':
+            op->type = JSON_SEL_OBJ;
+            break;
+        case '[':
+            op->type = JSON_SEL_ARRAY;
+            break;
+        case ':':
+            op->type = JSON_SEL_TYPECHECK;
+            break;
+        default:
+            goto fail;
+        }
+
+        start = ptr;
+        while (*ptr && !strchr(".[]:", *ptr)) {
+            ptr++;
+        }
+        len = ptr - start;
+        if (len == 0 || len > JSON_SEL_MAX_BUF) {
+            goto fail;
+        }
+
+        switch (op->type) {
+        case JSON_SEL_ARRAY:
+            if (*ptr != ']') {
+                goto fail;
+            }
+            ptr++;
+            if (len == 1 && *start == '*') {
+                op->wildcard = 1;
+            } else {
+                op->idx = (int)strtol(start, &end, 10);
+                if (end != start + len) {
+                    goto fail;
+                }
+            }
+            break;
+
+        case JSON_SEL_OBJ:
+            memcpy(keys, start, len);
+            keys[len] = '\0';
+            op->key = keys;
+            op->key_len = len;
+            keys += len + 1;
+            if ((end = strchr(op->key, '*')) != NULL) {
+                op->wildcard = 1;
+                op->prefix_len = end - op->key;
+            }
+            break;
+
+        case JSON_SEL_TYPECHECK:
+            if (len != 1 || !strchr("sfioab!", *start)) {
+                goto fail;
+            }
+            op->check = *start;
+            break;
+        }
+        sel->len++;
+    }
+
+    return sel;
+
+fail:
+    jsonSelectorRelease(sel);
+    return NULL;
+}
+
+/**
+ * Same as `jsonSelect` but with a selector from `jsonSelectorCompile`, an int
+ * or string must be passed for each wildcard in the order they appear.
+ */
+json *jsonSelectCompiled(json *j, jsonSelector *sel, ...) {
+    char path[JSON_SEL_MAX_BUF + 1], *key, *s;
+    int idx, len;
+    jsonSelectorOp *op;
+    va_list ap;
+
+    va_start(ap, sel);
+    for (int i = 0; i < sel->len && j; ++i) {
+        op = &sel->ops[i];
+
+        switch (op->type) {
+        case JSON_SEL_ARRAY:
+            idx = op->wildcard ? va_arg(ap, int) : op->idx;
+            j = jsonArrayAt(j, idx);
+            break;
+
+        case JSON_SEL_OBJ:
+            key = op->key;
+            if (op->wildcard) {
+                s = va_arg(ap, char *);
+                len = snprintf(path, sizeof(path), "%.*s%s%s", op->prefix_len,
+                               op->key, s, op->key + op->prefix_len + 1);
+                if (len > JSON_SEL_MAX_BUF) {
+                    j = NULL;
+                    break;
+                }
+                key = path;
+            }
+            j = jsonObjectAtCaseSensitive(j, key);
+            break;
+
+        case JSON_SEL_TYPECHECK:
+            if (!jsonTypeCheck(j, op->check)) {
+                j = NULL;
+            }
+            break;
+        }
+    }
+    va_end(ap);
+
+    return j;
+}
+
+static int jsonSaxTypeCheck(jsonSax *sax, char tk) {
+    switch (tk) {
+    case 's':
+        return sax->event == JSON_SAX_STRING;
+    case 'i':
+        return sax->event == JSON_SAX_INT;
+    case 'f':
+        return sax->event == JSON_SAX_FLOAT;
+    case 'o':
+        return sax->event == JSON_SAX_OBJECT_START;
+    case 'a':
+        return sax->event == JSON_SAX_ARRAY_START;
+    case 'b':
+        return sax->event == JSON_SAX_BOOL;
+    case '!':
+        return sax->event == JSON_SAX_NULL;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * From within a `jsonSaxCallback`, check if the current event is the value
+ * the selector would select from the tree. Wildcards match any index or key.
+ * Container end events never match.
+ */
+int jsonSelectorMatchSax(jsonSelector *sel, jsonSax *sax) {
+    jsonSaxFrame *frame;
+    jsonSelectorOp *op;
+    int level = 0;
+
+    if (sax->event == JSON_SAX_OBJECT_END || sax->event == JSON_SAX_ARRAY_END) {
+        return 0;
+    }
+
+    for (int i = 0; i < sel->len; ++i) {
+        op = &sel->ops[i];
+
+        if (op->type == JSON_SEL_TYPECHECK) {
+            /* Only meaningful once the whole path has matched */
+            if (level != sax->depth || !jsonSaxTypeCheck(sax, op->check)) {
+                return 0;
+            }
+            continue;
+        }
+
+        if (level == sax->depth) {
+            return 0;
+        }
+        frame = &sax->stack[level++];
+
+        if (op->type == JSON_SEL_ARRAY) {
+            if (frame->type != JSON_ARRAY ||
+                (!op->wildcard && frame->index != op->idx)) {
+                return 0;
+            }
+        } else {
+            if (frame->type != JSON_OBJECT) {
+                return 0;
+            }
+            if (op->wildcard) {
+                /* Text either side of the '*' must match */
+                int suffix_len = op->key_len - op->prefix_len - 1;
+                if (frame->key_len < (size_t)(op->prefix_len + suffix_len) ||
+                    memcmp(frame->key, op->key, op->prefix_len) != 0 ||
+                    memcmp(frame->key + frame->key_len - suffix_len,
+                           op->key + op->prefix_len + 1, suffix_len) != 0) {
+                    return 0;
+                }
+            } else if (frame->key_len != (size_t)op->key_len ||
+                       memcmp(frame->key, op->key, op->key_len) != 0) {
+                return 0;
+            }
+        }
+    }
+
+    return level == sax->depth;
+}
+
+void jsonSelectorRelease(jsonSelector *sel) {
+    if (sel) {
+        free(sel->ops);
+        free(sel->keys);
+        free(sel);
+    }
+}
@@ -13,7 +13,14 @@ extern "C" {
 
 #include "json.h"
 
+/* A selector path parsed ahead of time, see `jsonSelectorCompile` */
+typedef struct jsonSelector jsonSelector;
+
 json *jsonSelect(json *j, const char *fmt, ...);
+jsonSelector *jsonSelectorCompile(const char *fmt);
+json *jsonSelectCompiled(json *j, jsonSelector *sel, ...);
+int jsonSelectorMatchSax(jsonSelector *sel, jsonSax *sax);
+void jsonSelectorRelease(jsonSelector *sel);
 json *jsonArrayAt(json *j, int idx);
 json *jsonObjectAtCaseSensitive(json *j, const char *name);
 json *jsonObjectAtCaseInSensitive(json *j, const char *name);
@@ -14,6 +14,12 @@
 
 #include "json.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define __bufput(b, i, c) ((b)[(*i)++] = (c))
 
 #define isWhiteSpace(ch)                                                  \
@@ -25,7 +31,8 @@
 #define toInt(ch)           (ch - '0')
 #define toUpper(ch)         ((ch >= 'a' && ch <= 'z') ? (ch - 'a' + 'A') : ch)
 #define toHex(ch)           (toUpper(ch) - 'A' + 10)
-#define isNumTerminator(ch) (ch == ',' || ch == ']' || ch == '\0' || ch == '\n')
+#define isNumTerminator(ch) \
+    (ch == ',' || ch == ']' || ch == '}' || ch == '\0' || isWhiteSpace(ch))
 #define numStart(ch)        (isNum(ch) || ch == '-' || ch == '+' || ch == '.')
 
 #define json_debug(...)                                                    \
@@ -76,6 +83,10 @@ typedef struct jsonParser {
     /* State of the parser and the resulting state of the parsed json when
      * finished */
     jsonState *state;
+    /* If set all nodes and strings are allocated from here */
+    jsonArena *arena;
+    /* Used to decode strings with escapes, created on demand */
+    struct jsonString *scratch;
 } jsonParser;
 
 typedef struct jsonString {
@@ -250,14 +261,121 @@ char *jsonToString(json *j, size_t *_len) {
     return buffer;
 }
 
+/*=============================================================================
+ * JSON Arena routines
+ *============================================================================*/
+#define JSON_ARENA_ALIGN         (sizeof(void *))
+#define JSON_ARENA_DEFAULT_BLOCK (4096)
+
+typedef struct jsonArenaBlock {
+    struct jsonArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} jsonArenaBlock;
+
+struct jsonArena {
+    /* Block currently being allocated from, older blocks hang off of it */
+    jsonArenaBlock *head;
+    size_t block_size;
+};
+
+static jsonArenaBlock *jsonArenaBlockNew(size_t size) {
+    jsonArenaBlock *block = malloc(sizeof(jsonArenaBlock) + size);
+    if (block == NULL) {
+        json_debug_panic("OOM allocating arena block of %zu bytes\n", size);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * Create an arena that allocates in blocks of 'block_size', 0 for the default
+ */
+jsonArena *jsonArenaNew(size_t block_size) {
+    jsonArena *arena = malloc(sizeof(jsonArena));
+    arena->block_size = block_size ? block_size : JSON_ARENA_DEFAULT_BLOCK;
+    arena->head = jsonArenaBlockNew(arena->block_size);
+    return arena;
+}
+
+static void *jsonArenaAlloc(jsonArena *arena, size_t size) {
+    jsonArenaBlock *block = arena->head;
+    void *ptr;
+
+    size = (size + JSON_ARENA_ALIGN - 1) & ~(JSON_ARENA_ALIGN - 1);
+    if (block->used + size > block->size) {
+        block = jsonArenaBlockNew(size > arena->block_size ? size :
+                                  arena->block_size);
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/**
+ * Make all of the memory in the arena available again, anything allocated
+ * from it is no longer valid. If the last use needed more than one block they
+ * are replaced by a single block large enough to hold it all
+ */
+void jsonArenaReset(jsonArena *arena) {
+    jsonArenaBlock *block = arena->head, *next;
+    size_t total = 0;
+
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+
+    while (block) {
+        next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    arena->head = jsonArenaBlockNew(total);
+}
+
+void jsonArenaRelease(jsonArena *arena) {
+    if (arena) {
+        jsonArenaBlock *block = arena->head, *next;
+        while (block) {
+            next = block->next;
+            free(block);
+            block = next;
+        }
+        free(arena);
+    }
+}
+
 /*=============================================================================
  * JSON Parser routines
  *============================================================================*/
-static jsonState *jsonStateNew(void) {
-    jsonState *json_state = malloc(sizeof(jsonState));
+static void *jsonParserAlloc(jsonParser *p, size_t size) {
+    if (p->arena) {
+        return jsonArenaAlloc(p->arena, size);
+    }
+    return malloc(size);
+}
+
+static void jsonParserFree(jsonParser *p, void *ptr) {
+    if (p->arena == NULL) {
+        free(ptr);
+    }
+}
+
+static jsonState *jsonStateNew(jsonParser *p) {
+    jsonState *json_state = jsonParserAlloc(p, sizeof(jsonState));
     json_state->error = JSON_OK;
     json_state->ch = '\0';
     json_state->offset = 0;
+    json_state->arena = p->arena;
+    json_state->owns_arena = 0;
     return json_state;
 }
 
@@ -396,8 +514,8 @@ static size_t getNextNonWhitespaceIdx(const char *ptr) {
 /**
  * Create new json object
  */
-static json *jsonNew(void) {
-    json *J = malloc(sizeof(json));
+static json *jsonNew(jsonParser *p) {
+    json *J = jsonParserAlloc(p, sizeof(json));
     J->type = JSON_NULL;
     J->key = NULL;
     J->next = NULL;
@@ -480,6 +598,8 @@ static void jsonParserInit(jsonParser *p, char *buffer, size_t buflen) {
     p->J = NULL;
     p->ptr = NULL;
     p->errno = JSON_OK;
+    p->arena = NULL;
+    p->scratch = NULL;
 }
 
 /* All prototypes for parsing */
@@ -616,13 +736,10 @@ static ssize_t stringToI64(jsonParser *p, int neg) {
         case 'E':
             goto parse_exponent;
 
-        case ',':
-        case '\n':
-        case ']':
-        case '\0':
-            goto out;
-
         default:
+            if (!isNum(cur)) {
+                goto out;
+            }
             retval = retval * 10 + toInt(cur);
             break;
         }
@@ -810,10 +927,10 @@ static unsigned int parseHex4(const unsigned char *buf) {
     for (int i = 0; i < 4; ++i) {
         ch = buf[i];
         if (isHex(ch)) {
-            if (isHex(ch)) {
-                hex += toHex(ch);
-            } else {
+            if (isNum(ch)) {
                 hex += toInt(ch);
+            } else {
+                hex += toHex(ch);
             }
         } else {
             return INT_MAX;
@@ -845,7 +962,7 @@ static void utf8Encode(char *buffer, unsigned int codepoint, size_t *offset) {
         __bufput(buffer, offset, 0x80 | (codepoint & 0x3F));
     } else {
         /* For codepoints above 65535, encode using four bytes */
-        __bufput(buffer, offset, 0xE0 | ((codepoint >> 18) & 0xFF));
+        __bufput(buffer, offset, 0xF0 | ((codepoint >> 18) & 0xFF));
         __bufput(buffer, offset, 0x80 | ((codepoint >> 12) & 0x3F));
         __bufput(buffer, offset, 0x80 | ((codepoint >> 6) & 0x3F));
         __bufput(buffer, offset, 0x80 | (codepoint & 0x3F));
@@ -874,7 +991,7 @@ static unsigned int jsonParseUTF16(jsonParser *p) {
             }
 
             jsonAdvance(p);
-            if (jsonPeek(p) != '\\' &&
+            if (jsonPeek(p) != '\\' ||
                 jsonUnsafePeekAt(p, p->offset + 1) != 'u') {
                 return jsonAdvanceToError(p, 0, JSON_INVALID_UTF16);
             }
@@ -898,7 +1015,7 @@ static unsigned int jsonParseUTF16(jsonParser *p) {
             codepoint = (((codepoint - 0xD800) << 10) | (codepoint2 - 0xDC00)) +
                     0x10000;
             */
-            jsonCanAdvanceBy(p, 3);
+            jsonUnsafeAdvanceBy(p, 3);
         } else {
             return jsonAdvanceToError(p, 0, JSON_INVALID_UTF16);
         }
@@ -907,102 +1024,215 @@ static unsigned int jsonParseUTF16(jsonParser *p) {
     return codepoint;
 }
 
-static char *jsonParseString(jsonParser *p) {
-    int run = 1;
-    size_t start = p->offset;
-    size_t end = p->offset;
-
-    if (jsonPeek(p) == '"') {
-        jsonAdvance(p);
-        end++;
+/**
+ * Returns a pointer to the first '"', '\\' or control character in
+ * [ptr, end) or `end` if there is none. Most strings, even long ones, have no
+ * escapes so this lets them be copied in one go. 32 bytes at a time with
+ * AVX2 (-mavx2 or -march=native), otherwise 16 at a time with SSE2.
+ */
+static const char *jsonScanString(const char *ptr, const char *end) {
+#if defined(__AVX2__)
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i backslash32 = _mm256_set1_epi8('\\');
+    const __m256i control32 = _mm256_set1_epi8(0x1F);
+
+    while (end - ptr >= 32) {
+        const __m256i s = _mm256_loadu_si256((const __m256i *)ptr);
+        /* max(s, 0x1F) == 0x1F only for bytes <= 0x1F */
+        __m256i x = _mm256_cmpeq_epi8(s, quote32);
+        x = _mm256_or_si256(x, _mm256_cmpeq_epi8(s, backslash32));
+        x = _mm256_or_si256(
+                x, _mm256_cmpeq_epi8(_mm256_max_epu8(s, control32), control32));
+        unsigned int r = (unsigned int)_mm256_movemask_epi8(x);
+        if (r != 0) {
+            return ptr + __builtin_ctz(r);
+        }
+        ptr += 32;
     }
+#endif
+#if defined(__SSE2__)
+    const __m128i quote16 = _mm_set1_epi8('"');
+    const __m128i backslash16 = _mm_set1_epi8('\\');
+    const __m128i control16 = _mm_set1_epi8(0x1F);
+
+    while (end - ptr >= 16) {
+        const __m128i s = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i x = _mm_cmpeq_epi8(s, quote16);
+        x = _mm_or_si128(x, _mm_cmpeq_epi8(s, backslash16));
+        x = _mm_or_si128(x, _mm_cmpeq_epi8(_mm_max_epu8(s, control16),
+                                           control16));
+        unsigned int r = (unsigned int)_mm_movemask_epi8(x);
+        if (r != 0) {
+            return ptr + __builtin_ctz(r);
+        }
+        ptr += 16;
+    }
+#endif
+    while (ptr < end && *ptr != '"' && *ptr != '\\' &&
+           (unsigned char)*ptr > 0x1F) {
+        ++ptr;
+    }
+    return ptr;
+}
 
-    /* approximate string length */
-    while (jsonUnsafePeekAt(p, end) != '\0') {
-        char cur = jsonUnsafePeekAt(p, end);
-        if (cur == '"') {
-            if (jsonUnsafePeekAt(p, end - 1) != '\\') {
-                break;
-            }
-        } else if (cur == '\\') {
-            // escape sequence so add another byte
-            if (jsonUnsafePeekAt(p, end + 1) == '\0') {
-                break;
-            }
-            end++;
+/**
+ * Escapes are decoded into a scratch buffer shared by every string in the
+ * parse, the result is then copied out at its exact size
+ */
+static int jsonParseEscape(jsonParser *p, const char **_ptr) {
+    const char *ptr = *_ptr;
+    char utf8[4];
+    size_t len = 0;
+    char ch;
+
+    switch (*ptr) {
+    case '\\':
+    case '"':
+    case '/':
+        ch = *ptr;
+        break;
+    case 'b':
+        ch = '\b';
+        break;
+    case 'f':
+        ch = '\f';
+        break;
+    case 'n':
+        ch = '\n';
+        break;
+    case 'r':
+        ch = '\r';
+        break;
+    case 't':
+        ch = '\t';
+        break;
+    case 'u': {
+        p->offset = ptr - p->buffer;
+        unsigned int codepoint = jsonParseUTF16(p);
+        if (p->errno != JSON_OK) {
+            return 0;
         }
-        end++;
+        utf8Encode(utf8, codepoint, &len);
+        jsonStringCatLen(p->scratch, utf8, len);
+        /* jsonParseUTF16 leaves us on the last hex digit */
+        *_ptr = p->buffer + p->offset + 1;
+        return 1;
+    }
+    default:
+        p->offset = ptr - p->buffer;
+        p->errno = JSON_INVALID_ESCAPE_CHARACTER;
+        return 0;
     }
 
-    if (jsonUnsafePeekAt(p, end) == '\0') {
-        p->errno = JSON_EOF;
-        return NULL;
+    jsonStringCatLen(p->scratch, &ch, 1);
+    *_ptr = ptr + 1;
+    return 1;
+}
+
+/**
+ * Decode the string at the current offset and move past it. Returns a pointer
+ * to the contents, which is not NUL terminated: straight into the buffer if
+ * there are no escapes otherwise into the scratch buffer. Only valid until
+ * the next string is decoded.
+ */
+static const char *jsonParseStringRaw(jsonParser *p, size_t *_len) {
+    const char *end = p->buffer + p->buflen;
+    const char *ptr = p->buffer + p->offset;
+    const char *start, *run, *special;
+
+    if (*ptr == '"') {
+        ptr++;
     }
 
-    size_t len = 0;
-    char *str = malloc(sizeof(char) * end - start);
+    /* Fast path, no escapes */
+    special = jsonScanString(ptr, end);
+    if (special < end && *special == '"') {
+        start = ptr;
+        *_len = special - ptr;
+        goto done;
+    }
 
-    while (run && jsonPeek(p) != '\0') {
-        switch (jsonPeek(p)) {
-        case '\\':
-            jsonAdvance(p);
-            switch (jsonPeek(p)) {
-            case '\\':
-            case '"':
-            case '/':
-                __bufput(str, &len, jsonPeek(p));
-                break;
-            case 'b':
-                __bufput(str, &len, '\b');
-                break;
-            case 'f':
-                __bufput(str, &len, '\f');
-                break;
-            case 'n':
-                __bufput(str, &len, '\n');
-                break;
-            case 'r':
-                __bufput(str, &len, '\r');
-                break;
-            case 't':
-                __bufput(str, &len, '\t');
-                break;
-            case 'u': {
-                unsigned int codepoint = jsonParseUTF16(p);
-                if (p->errno != JSON_OK) {
-                    goto err;
-                }
-                utf8Encode(str, codepoint, &len);
-                break;
+    if (p->scratch == NULL) {
+        p->scratch = jsonStringNew();
+    }
+    p->scratch->len = 0;
+    run = ptr;
+
+    while (1) {
+        if (special >= end || *special == '\0') {
+            p->offset = special - p->buffer;
+            p->errno = JSON_EOF;
+            return NULL;
+        }
+
+        if (*special == '"') {
+            break;
+        }
+
+        jsonStringCatLen(p->scratch, run, special - run);
+        if (*special == '\\') {
+            if (special + 1 >= end) {
+                p->offset = special - p->buffer;
+                p->errno = JSON_EOF;
+                return NULL;
             }
-            default:
-                p->errno = JSON_INVALID_ESCAPE_CHARACTER;
-                goto err;
+            ptr = special + 1;
+            if (!jsonParseEscape(p, &ptr)) {
+                return NULL;
             }
-            break;
-        case '"':
-            run = 0;
-            break;
-        default:
-            __bufput(str, &len, jsonPeek(p));
-            break;
+        } else {
+            /* Raw control characters are passed through as they are */
+            jsonStringCatLen(p->scratch, special, 1);
+            ptr = special + 1;
         }
-        jsonAdvance(p);
+        run = ptr;
+        special = jsonScanString(ptr, end);
     }
 
-    if (jsonPeek(p) == '"') {
-        p->errno = JSON_INVALID_STRING_NOT_TERMINATED;
-        goto err;
+    jsonStringCatLen(p->scratch, run, special - run);
+    start = p->scratch->buffer;
+    *_len = p->scratch->len;
+
+done:
+    /* Move past the closing '"', which may be the last character of the buffer
+     * when parsing a single token */
+    p->offset = special - p->buffer + 1;
+    return start;
+}
+
+static char *jsonParseString(jsonParser *p) {
+    const char *raw;
+    size_t len;
+    char *str;
+
+    if ((raw = jsonParseStringRaw(p, &len)) == NULL) {
+        return NULL;
     }
 
+    str = jsonParserAlloc(p, len + 1);
+    memcpy(str, raw, len);
     str[len] = '\0';
     return str;
+}
 
-err:
-    if (str) {
-        free(str);
+/* With JSON_STRNUM_FLAG the number is kept as it appears in the buffer */
+static char *jsonParseStrnum(jsonParser *p) {
+    char *ptr = p->buffer + p->offset;
+    int len = countNumberLen(p, ptr);
+    char *str;
+
+    if (len == 0 || p->errno != JSON_OK) {
+        if (p->errno == JSON_OK) {
+            p->errno = JSON_INVALID_NUMBER;
+        }
+        return NULL;
     }
-    return NULL;
+
+    str = jsonParserAlloc(p, len + 1);
+    memcpy(str, ptr, len);
+    str[len] = '\0';
+    jsonUnsafeAdvanceBy(p, len);
+    return str;
 }
 
 /**
@@ -1117,7 +1347,7 @@ static json *jsonParseObject(jsonParser *p) {
     char ch = '\0';
     int can_advance = 0;
     json *J;
-    json *val = jsonNew();
+    json *val = jsonNew(p);
     p->ptr = val;
 
     while (1) {
@@ -1125,7 +1355,7 @@ static json *jsonParseObject(jsonParser *p) {
         jsonAdvanceWhitespace(p);
 
         if (jsonPeek(p) != '"') {
-            free(val);
+            jsonParserFree(p, val);
             p->errno = JSON_INVALID_KEY_TERMINATOR_CHARACTER;
             return NULL;
         }
@@ -1133,7 +1363,7 @@ static json *jsonParseObject(jsonParser *p) {
         J->key = jsonParseString(p);
         jsonAdvanceToTerminator(p, ':');
         if (jsonPeek(p) != ':') {
-            free(val);
+            jsonParserFree(p, val);
             p->errno = JSON_INVALID_KEY_TERMINATOR_CHARACTER;
             return NULL;
         }
@@ -1155,14 +1385,14 @@ static json *jsonParseObject(jsonParser *p) {
             } else if (ch == '}' && !can_advance) {
                 break;
             } else {
-                free(val);
+                jsonParserFree(p, val);
                 p->errno = JSON_INVALID_JSON_TYPE_CHAR;
                 return NULL;
             }
         }
 
         jsonAdvance(p);
-        J->next = jsonNew();
+        J->next = jsonNew(p);
         p->ptr = J->next;
     }
 
@@ -1187,7 +1417,7 @@ static json *jsonParseArray(jsonParser *p) {
     char ch = '\0';
     int can_advance = 0;
     json *J;
-    json *val = jsonNew();
+    json *val = jsonNew(p);
     p->ptr = val;
 
     while (1) {
@@ -1208,14 +1438,14 @@ static json *jsonParseArray(jsonParser *p) {
             } else if (ch == ']' && !can_advance) {
                 break;
             } else {
-                free(val);
+                jsonParserFree(p, val);
                 p->errno = JSON_INVALID_ARRAY_CHARACTER;
                 return NULL;
             }
         }
 
         jsonAdvance(p);
-        J->next = jsonNew();
+        J->next = jsonNew(p);
         p->ptr = J->next;
     }
 
@@ -1234,7 +1464,7 @@ static int jsonParseValue(jsonParser *p) {
     case JSON_PARSER_NUMERIC: {
         if (p->flags & JSON_STRNUM_FLAG) {
             J->type = JSON_STRNUM;
-            J->strnum = jsonParseString(p);
+            J->strnum = jsonParseStrnum(p);
         } else {
             jsonParseNumber(p);
         }
@@ -1309,7 +1539,7 @@ static unsigned char *escapeString(char *buf) {
     }
 
     len = (size_t)(ptr - (unsigned char *)buf) + escape_chars;
-    outbuf = malloc(sizeof(char) * len);
+    outbuf = malloc(sizeof(char) * (len + 1));
 
     if (escape_chars == 0) {
         memcpy(outbuf, buf, len);
@@ -1448,9 +1678,23 @@ void jsonRelease(json *J) {
     if (J == NULL) {
         return;
     }
+
+    /* The whole tree goes in one go */
+    if (J->state && J->state->arena) {
+        if (J->state->owns_arena) {
+            jsonArenaRelease(J->state->arena);
+        } else {
+            jsonArenaReset(J->state->arena);
+        }
+        return;
+    }
+
     json *ptr = J;
     json *next = NULL;
 
+    /* Only present on the root */
+    free(J->state);
+
     while (ptr) {
         next = ptr->next;
         if (ptr->key) {
@@ -1604,6 +1848,12 @@ static jsonString *_jsonGetStrerror(JSON_ERRNO error, char ch, size_t offset) {
         jsonStringCatf(js, "Unexpected end of json buffer at position: %zu",
                        offset);
         break;
+    case JSON_SAX_LIMIT:
+        jsonStringCatf(js,
+                       "Nesting or key length exceeds the SAX parser's limits "
+                       "at position: %zu",
+                       offset);
+        break;
     }
     return js;
 }
@@ -1633,25 +1883,16 @@ void jsonPrintError(json *J) {
     }
 }
 
-/**
- * Parse null terminated string buffer to a json struct. The length of the json
- * string must be known ahead of time.
- *
- * Pass in flags to modify the behaviour of the parser:
- * - JSON_STRNUM_FLAG: do not try to parse numbers: floats,hex, ints etc..
- *   will be treated as strings.
- * - JSON_STATE_FLAG: Maintain state for the parse, capturing errors
- *
- * You must free the resulting pointer with `jsonRelease`
- */
-json *jsonParseWithLenAndFlags(char *raw_json, size_t buflen, int flags) {
+static json *jsonParseInternal(char *raw_json, size_t buflen, int flags,
+                               jsonArena *arena) {
     jsonParser p;
     p.flags = flags;
     jsonParserInit(&p, raw_json, buflen);
+    p.arena = arena;
 
     jsonAdvanceWhitespace(&p);
     char peek = jsonPeek(&p);
-    json *J = jsonNew();
+    json *J = jsonNew(&p);
 
     p.J = J;
 
@@ -1669,7 +1910,9 @@ json *jsonParseWithLenAndFlags(char *raw_json, size_t buflen, int flags) {
         p.errno = JSON_CANNOT_START_PARSE;
     }
 
-    J->state = jsonStateNew();
+    jsonStringRelease(p.scratch);
+
+    J->state = jsonStateNew(&p);
     J->state->error = p.errno;
     J->state->ch = p.buffer[p.offset];
     J->state->offset = p.offset;
@@ -1685,6 +1928,47 @@ json *jsonParseWithLenAndFlags(char *raw_json, size_t buflen, int flags) {
     return J;
 }
 
+/**
+ * Parse null terminated string buffer to a json struct. The length of the json
+ * string must be known ahead of time.
+ *
+ * Pass in flags to modify the behaviour of the parser:
+ * - JSON_STRNUM_FLAG: do not try to parse numbers: floats,hex, ints etc..
+ *   will be treated as strings.
+ * - JSON_STATE_FLAG: Maintain state for the parse, capturing errors
+ *
+ * You must free the resulting pointer with `jsonRelease`
+ */
+json *jsonParseWithLenAndFlags(char *raw_json, size_t buflen, int flags) {
+    return jsonParseInternal(raw_json, buflen, flags, NULL);
+}
+
+/**
+ * Parse a string buffer of 'buflen' allocating every node and string from an
+ * arena rather than individually.
+ *
+ * If 'arena' is NULL one is created and `jsonRelease` frees it, and with it
+ * the whole tree, in one go.
+ *
+ * Otherwise the arena is borrowed and `jsonRelease` resets it so it can be
+ * reused for the next parse without going back to malloc. Only one tree can
+ * be alive in a borrowed arena at a time.
+ */
+json *jsonParseWithArena(char *raw_json, size_t buflen, int flags,
+                         jsonArena *arena) {
+    json *J;
+
+    if (arena) {
+        return jsonParseInternal(raw_json, buflen, flags, arena);
+    }
+
+    /* The tree is generally about double the size of the text */
+    arena = jsonArenaNew(buflen * 2 > JSON_ARENA_DEFAULT_BLOCK ? buflen * 2 : 0);
+    J = jsonParseInternal(raw_json, buflen, flags, arena);
+    J->state->owns_arena = 1;
+    return J;
+}
+
 /**
  * Parse null terminated string buffer to a json struct. The length of the json
  * string must be known ahead of time.
@@ -1820,3 +2104,645 @@ int jsonGetError(json *J) {
 int jsonOk(json *J) {
     return jsonGetError(J) == JSON_OK;
 }
+
+/*=============================================================================
+ * SAX parsing, walks the input calling back for every value without building
+ * a tree. The input can arrive in any number of chunks split at any byte, the
+ * parser is a state machine that picks up where the last chunk left off. Only
+ * a token (string, number or literal) that straddles two chunks is copied,
+ * everything else is handed out in place. The path to the current value is
+ * kept on a fixed size stack so memory use does not grow with the input
+ *============================================================================*/
+
+/* What the parser expects next */
+#define JSON_SAX_STATE_START        (0) /* '{' or '[' */
+#define JSON_SAX_STATE_VALUE        (1)
+#define JSON_SAX_STATE_VALUE_OR_END (2) /* First element of an array */
+#define JSON_SAX_STATE_KEY          (3)
+#define JSON_SAX_STATE_KEY_OR_END   (4) /* First member of an object */
+#define JSON_SAX_STATE_COLON        (5)
+#define JSON_SAX_STATE_NEXT         (6) /* ',' or the end of the container */
+#define JSON_SAX_STATE_DONE         (7)
+
+/* Token being carried over to the next chunk */
+#define JSON_SAX_TOKEN_NONE   (0)
+#define JSON_SAX_TOKEN_STRING (1)
+#define JSON_SAX_TOKEN_BARE   (2) /* Number, true, false or null */
+
+#define isBareChar(ch)                                                    \
+    (isNum(ch) || ((ch) >= 'a' && (ch) <= 'z') || (ch) == '-' ||         \
+     (ch) == '+' || (ch) == '.' || (ch) == 'E')
+
+/**
+ * Create a SAX parser that can be reused for any number of documents
+ */
+jsonSax *jsonSaxNew(jsonSaxCallback *callback, void *privdata) {
+    jsonSax *sax = malloc(sizeof(jsonSax));
+    sax->callback = callback;
+    sax->privdata = privdata;
+    sax->scratch = NULL;
+    sax->carry = NULL;
+    jsonSaxReset(sax);
+    return sax;
+}
+
+/* Get ready for a new document */
+void jsonSaxReset(jsonSax *sax) {
+    sax->state = JSON_SAX_STATE_START;
+    sax->token = JSON_SAX_TOKEN_NONE;
+    sax->escaped = 0;
+    sax->stopped = 0;
+    sax->consumed = 0;
+    sax->depth = 0;
+    sax->error = JSON_OK;
+    sax->ch = '\0';
+    sax->offset = 0;
+}
+
+void jsonSaxRelease(jsonSax *sax) {
+    if (sax) {
+        jsonStringRelease(sax->scratch);
+        jsonStringRelease(sax->carry);
+        free(sax);
+    }
+}
+
+static int jsonSaxError(jsonSax *sax, JSON_ERRNO error) {
+    sax->error = error;
+    return 0;
+}
+
+static int jsonSaxEmit(jsonSax *sax, JSON_SAX_EVENT event) {
+    sax->event = event;
+    if (!sax->callback(sax, sax->privdata)) {
+        sax->stopped = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int jsonSaxOpen(jsonSax *sax, char ch) {
+    jsonSaxFrame *frame, *parent;
+
+    if (!jsonSaxEmit(sax, ch == '{' ? JSON_SAX_OBJECT_START :
+                                      JSON_SAX_ARRAY_START)) {
+        return 0;
+    }
+
+    if (sax->depth == JSON_SAX_MAX_DEPTH) {
+        return jsonSaxError(sax, JSON_SAX_LIMIT);
+    }
+
+    frame = &sax->stack[sax->depth];
+    frame->type = ch == '{' ? JSON_OBJECT : JSON_ARRAY;
+    frame->index = 0;
+    frame->key_len = 0;
+    /* Keys are stacked one after the other */
+    if (sax->depth == 0) {
+        frame->key = sax->keys;
+    } else {
+        parent = &sax->stack[sax->depth - 1];
+        /* The parent's key can end right at the end of `keys` */
+        if ((parent->key + parent->key_len + 1) - sax->keys >=
+            JSON_SAX_MAX_KEYS) {
+            return jsonSaxError(sax, JSON_SAX_LIMIT);
+        }
+        frame->key = parent->key + parent->key_len + 1;
+    }
+    frame->key[0] = '\0';
+    sax->depth++;
+    sax->state = ch == '{' ? JSON_SAX_STATE_KEY_OR_END :
+                             JSON_SAX_STATE_VALUE_OR_END;
+    return 1;
+}
+
+static int jsonSaxClose(jsonSax *sax, char ch) {
+    jsonSaxFrame *frame = &sax->stack[sax->depth - 1];
+
+    if (ch == '}' && frame->type != JSON_OBJECT) {
+        return jsonSaxError(sax, JSON_INVALID_ARRAY_CHARACTER);
+    } else if (ch == ']' && frame->type != JSON_ARRAY) {
+        return jsonSaxError(sax, JSON_INVALID_JSON_TYPE_CHAR);
+    }
+
+    sax->depth--;
+    sax->state = sax->depth ? JSON_SAX_STATE_NEXT : JSON_SAX_STATE_DONE;
+    return jsonSaxEmit(sax, ch == '}' ? JSON_SAX_OBJECT_END :
+                                        JSON_SAX_ARRAY_END);
+}
+
+static int jsonSaxSetKey(jsonSax *sax, const char *key, size_t len) {
+    jsonSaxFrame *frame = &sax->stack[sax->depth - 1];
+
+    if ((frame->key - sax->keys) + len + 1 > JSON_SAX_MAX_KEYS) {
+        return jsonSaxError(sax, JSON_SAX_LIMIT);
+    }
+
+    memcpy(frame->key, key, len);
+    frame->key[len] = '\0';
+    frame->key_len = len;
+    sax->state = JSON_SAX_STATE_COLON;
+    return 1;
+}
+
+/* A decoded string is either a key or a value */
+static int jsonSaxString(jsonSax *sax, const char *str, size_t len) {
+    if (sax->state == JSON_SAX_STATE_KEY ||
+        sax->state == JSON_SAX_STATE_KEY_OR_END) {
+        return jsonSaxSetKey(sax, str, len);
+    }
+    sax->str = str;
+    sax->len = len;
+    sax->state = JSON_SAX_STATE_NEXT;
+    return jsonSaxEmit(sax, JSON_SAX_STRING);
+}
+
+/**
+ * Parse a complete string, key or bare token. A bare token must be followed
+ * by a readable character; the next one in the chunk or the NUL of the carry
+ */
+static int jsonSaxToken(jsonSax *sax, int token, char *tok, size_t len) {
+    jsonParser p;
+    json tmp;
+    const char *str;
+    size_t str_len;
+
+    if (token == JSON_SAX_TOKEN_STRING) {
+        jsonParserInit(&p, tok, len);
+        p.flags = JSON_NO_FLAGS;
+        p.scratch = sax->scratch;
+        str = jsonParseStringRaw(&p, &str_len);
+        sax->scratch = p.scratch;
+        if (str == NULL) {
+            return jsonSaxError(sax, p.errno);
+        }
+        return jsonSaxString(sax, str, str_len);
+    }
+
+    sax->state = JSON_SAX_STATE_NEXT;
+    sax->str = tok;
+    sax->len = len;
+
+    switch (*tok) {
+    case 't':
+    case 'f':
+        if ((len == 4 && !memcmp(tok, "true", 4)) ||
+            (len == 5 && !memcmp(tok, "false", 5))) {
+            sax->boolean = *tok == 't';
+            return jsonSaxEmit(sax, JSON_SAX_BOOL);
+        }
+        return jsonSaxError(sax, JSON_INVALID_BOOL);
+
+    case 'n':
+        if (len == 4 && !memcmp(tok, "null", 4)) {
+            return jsonSaxEmit(sax, JSON_SAX_NULL);
+        }
+        return jsonSaxError(sax, JSON_INVALID_TYPE);
+    }
+
+    /* The number parser stops on the character after the number */
+    jsonParserInit(&p, tok, len + 1);
+    p.flags = JSON_NO_FLAGS;
+    p.ptr = &tmp;
+    jsonParseNumber(&p);
+    if (p.errno != JSON_OK || p.offset != len) {
+        return jsonSaxError(sax, JSON_INVALID_NUMBER);
+    }
+
+    if (tmp.type == JSON_FLOAT) {
+        sax->floating = tmp.floating;
+        return jsonSaxEmit(sax, JSON_SAX_FLOAT);
+    }
+    sax->integer = tmp.integer;
+    return jsonSaxEmit(sax, JSON_SAX_INT);
+}
+
+/**
+ * Find the closing '"' of a string, 'ptr' is past the opening quote. Returns
+ * NULL if the string carries on past 'end', in which case '*escaped' is set if
+ * the last character was a '\\' yet to be paired with what it escapes
+ */
+static char *jsonSaxStringEnd(char *ptr, char *end, int *escaped) {
+    if (*escaped) {
+        if (ptr == end) {
+            return NULL;
+        }
+        ptr++;
+        *escaped = 0;
+    }
+
+    while ((ptr = (char *)jsonScanString(ptr, end)) < end) {
+        if (*ptr == '"') {
+            return ptr;
+        } else if (*ptr == '\\') {
+            if (ptr + 1 == end) {
+                *escaped = 1;
+                return NULL;
+            }
+            ptr += 2;
+        } else {
+            ptr++;
+        }
+    }
+    return NULL;
+}
+
+/* One past the end of a number or literal, NULL if it may carry on past
+ * 'end' */
+static char *jsonSaxBareEnd(char *ptr, char *end) {
+    while (ptr < end && isBareChar(*ptr)) {
+        ptr++;
+    }
+    return ptr < end ? ptr : NULL;
+}
+
+/* Parse the token at '*ptr' if it ends within this chunk, otherwise keep it
+ * for the next */
+static int jsonSaxStartToken(jsonSax *sax, int token, char **ptr, char *end) {
+    char *start = *ptr, *tok_end;
+    int escaped = 0;
+
+    if (token == JSON_SAX_TOKEN_STRING) {
+        /* Fast path, no escapes so the string is used as it is */
+        tok_end = (char *)jsonScanString(start + 1, end);
+        if (tok_end < end && *tok_end == '"') {
+            if (!jsonSaxString(sax, start + 1, tok_end - start - 1)) {
+                return 0;
+            }
+            *ptr = tok_end + 1;
+            return 1;
+        }
+        if ((tok_end = jsonSaxStringEnd(tok_end, end, &escaped)) != NULL) {
+            tok_end++;
+        }
+    } else {
+        tok_end = jsonSaxBareEnd(start, end);
+    }
+
+    if (tok_end == NULL) {
+        if (sax->carry == NULL) {
+            sax->carry = jsonStringNew();
+        }
+        sax->carry->len = 0;
+        jsonStringCatLen(sax->carry, start, end - start);
+        sax->token = token;
+        sax->escaped = escaped;
+        *ptr = end;
+        return 1;
+    }
+
+    if (!jsonSaxToken(sax, token, start, tok_end - start)) {
+        return 0;
+    }
+    *ptr = tok_end;
+    return 1;
+}
+
+/* Complete the token carried over from the previous chunk */
+static int jsonSaxResumeToken(jsonSax *sax, char **ptr, char *end) {
+    char *start = *ptr, *tok_end;
+    int token = sax->token;
+
+    if (token == JSON_SAX_TOKEN_STRING) {
+        if ((tok_end = jsonSaxStringEnd(start, end, &sax->escaped)) != NULL) {
+            tok_end++;
+        }
+    } else {
+        tok_end = jsonSaxBareEnd(start, end);
+    }
+
+    if (tok_end == NULL) {
+        jsonStringCatLen(sax->carry, start, end - start);
+        *ptr = end;
+        return 1;
+    }
+
+    jsonStringCatLen(sax->carry, start, tok_end - start);
+    sax->token = JSON_SAX_TOKEN_NONE;
+    if (!jsonSaxToken(sax, token, sax->carry->buffer, sax->carry->len)) {
+        return 0;
+    }
+    *ptr = tok_end;
+    return 1;
+}
+
+/**
+ * Feed the next 'len' bytes of the document, which need not be NUL
+ * terminated nor end on a token boundary. Returns JSON_OK, also once the
+ * callback has stopped the parse or the document is complete, after which
+ * anything fed is ignored. Otherwise the error, which is also left on
+ * `sax->error` along with its offset into the document.
+ */
+int jsonSaxFeed(jsonSax *sax, char *chunk, size_t len) {
+    char *ptr = chunk, *end = chunk + len;
+    jsonSaxFrame *frame;
+    char ch;
+
+    if (sax->error != JSON_OK || sax->stopped ||
+        sax->state == JSON_SAX_STATE_DONE) {
+        return sax->error;
+    }
+
+    if (sax->token != JSON_SAX_TOKEN_NONE &&
+        !jsonSaxResumeToken(sax, &ptr, end)) {
+        goto out;
+    }
+
+    while (ptr < end) {
+        ch = *ptr;
+        if (isWhiteSpace(ch)) {
+            ptr++;
+            continue;
+        }
+
+        switch (sax->state) {
+        case JSON_SAX_STATE_START:
+            if (ch != '{' && ch != '[') {
+                jsonSaxError(sax, JSON_CANNOT_START_PARSE);
+                goto out;
+            }
+            if (!jsonSaxOpen(sax, ch)) {
+                goto out;
+            }
+            ptr++;
+            break;
+
+        case JSON_SAX_STATE_KEY_OR_END:
+            if (ch == '}') {
+                if (!jsonSaxClose(sax, ch)) {
+                    goto out;
+                }
+                ptr++;
+                break;
+            }
+            /* fallthrough */
+        case JSON_SAX_STATE_KEY:
+            if (ch != '"') {
+                jsonSaxError(sax, JSON_INVALID_KEY_TERMINATOR_CHARACTER);
+                goto out;
+            }
+            if (!jsonSaxStartToken(sax, JSON_SAX_TOKEN_STRING, &ptr, end)) {
+                goto out;
+            }
+            break;
+
+        case JSON_SAX_STATE_COLON:
+            if (ch != ':') {
+                jsonSaxError(sax, JSON_INVALID_KEY_VALUE_SEPARATOR);
+                goto out;
+            }
+            sax->state = JSON_SAX_STATE_VALUE;
+            ptr++;
+            break;
+
+        case JSON_SAX_STATE_VALUE_OR_END:
+            if (ch == ']') {
+                if (!jsonSaxClose(sax, ch)) {
+                    goto out;
+                }
+                ptr++;
+                break;
+            }
+            /* fallthrough */
+        case JSON_SAX_STATE_VALUE:
+            if (ch == '{' || ch == '[') {
+                if (!jsonSaxOpen(sax, ch)) {
+                    goto out;
+                }
+                ptr++;
+            } else if (ch == '"') {
+                if (!jsonSaxStartToken(sax, JSON_SAX_TOKEN_STRING, &ptr,
+                                       end)) {
+                    goto out;
+                }
+            } else if (numStart(ch) || ch == 't' || ch == 'f' || ch == 'n') {
+                if (!jsonSaxStartToken(sax, JSON_SAX_TOKEN_BARE, &ptr, end)) {
+                    goto out;
+                }
+            } else {
+                jsonSaxError(sax, JSON_INVALID_JSON_TYPE_CHAR);
+                goto out;
+            }
+            break;
+
+        case JSON_SAX_STATE_NEXT:
+            frame = &sax->stack[sax->depth - 1];
+            if (ch == ',') {
+                frame->index++;
+                sax->state = frame->type == JSON_OBJECT ?
+                                     JSON_SAX_STATE_KEY :
+                                     JSON_SAX_STATE_VALUE;
+                ptr++;
+            } else if (ch == '}' || ch == ']') {
+                if (!jsonSaxClose(sax, ch)) {
+                    goto out;
+                }
+                ptr++;
+            } else {
+                jsonSaxError(sax, frame->type == JSON_OBJECT ?
+                                          JSON_INVALID_JSON_TYPE_CHAR :
+                                          JSON_INVALID_ARRAY_CHARACTER);
+                goto out;
+            }
+            break;
+
+        case JSON_SAX_STATE_DONE:
+            /* Whatever follows the document is ignored */
+            ptr = end;
+            break;
+        }
+    }
+
+out:
+    if (sax->error != JSON_OK) {
+        sax->offset = sax->consumed + (ptr - chunk);
+        sax->ch = ptr < end ? *ptr : '\0';
+    }
+    sax->consumed += len;
+    return sax->error;
+}
+
+/**
+ * There is no more input, returns JSON_EOF if the document is incomplete and
+ * the parse was not stopped by the callback
+ */
+int jsonSaxFinish(jsonSax *sax) {
+    if (sax->error == JSON_OK && !sax->stopped &&
+        sax->state != JSON_SAX_STATE_DONE) {
+        sax->error = JSON_EOF;
+        sax->offset = sax->consumed;
+        sax->ch = '\0';
+    }
+    return sax->error;
+}
+
+/**
+ * Parse a whole document of 'buflen' in one go, see `jsonSaxFeed`. No memory
+ * is allocated other than scratch buffers for strings with escapes and
+ * numbers, which are kept for the lifetime of the parser.
+ */
+int jsonSaxParse(jsonSax *sax, char *raw_json, size_t buflen) {
+    jsonSaxReset(sax);
+    jsonSaxFeed(sax, raw_json, buflen);
+    return jsonSaxFinish(sax);
+}
+
+void jsonSaxPrintError(jsonSax *sax) {
+    if (sax->error != JSON_OK) {
+        jsonString *js = _jsonGetStrerror(sax->error, sax->ch, sax->offset);
+        fprintf(stderr, "%s\n", js->buffer);
+        jsonStringRelease(js);
+    } else {
+        fprintf(stderr, "No errors\n");
+    }
+}
+
+/*=============================================================================
+ * Push parsing, builds the same tree as `jsonParse` from SAX events so the
+ * document can be fed in as it arrives rather than buffered first
+ *============================================================================*/
+
+struct jsonPushParser {
+    jsonSax *sax;
+    jsonParser p; /* Allocates the nodes and carries the flags */
+    json *root;
+    json *containers[JSON_SAX_MAX_DEPTH]; /* Open objects and arrays */
+    json *tails[JSON_SAX_MAX_DEPTH];      /* Last child of each */
+};
+
+static int jsonPushParserEvent(jsonSax *sax, void *privdata) {
+    jsonPushParser *pp = (jsonPushParser *)privdata;
+    jsonParser *p = &pp->p;
+    jsonSaxFrame *frame;
+    json *J, *parent;
+    int depth = sax->depth;
+
+    switch (sax->event) {
+    case JSON_SAX_OBJECT_END:
+    case JSON_SAX_ARRAY_END:
+        return 1;
+    default:
+        break;
+    }
+
+    J = jsonNew(p);
+    if (depth == 0) {
+        pp->root = J;
+    } else {
+        frame = &sax->stack[depth - 1];
+        parent = pp->containers[depth - 1];
+        if (frame->type == JSON_OBJECT) {
+            J->key = jsonParserAlloc(p, frame->key_len + 1);
+            memcpy(J->key, frame->key, frame->key_len + 1);
+        }
+        if (pp->tails[depth - 1]) {
+            pp->tails[depth - 1]->next = J;
+        } else if (parent->type == JSON_OBJECT) {
+            parent->object = J;
+        } else {
+            parent->array = J;
+        }
+        pp->tails[depth - 1] = J;
+    }
+
+    switch (sax->event) {
+    case JSON_SAX_OBJECT_START:
+        J->type = JSON_OBJECT;
+        J->object = NULL;
+        pp->containers[depth] = J;
+        pp->tails[depth] = NULL;
+        break;
+
+    case JSON_SAX_ARRAY_START:
+        J->type = JSON_ARRAY;
+        J->array = NULL;
+        pp->containers[depth] = J;
+        pp->tails[depth] = NULL;
+        break;
+
+    case JSON_SAX_STRING:
+        J->type = JSON_STRING;
+        J->str = jsonParserAlloc(p, sax->len + 1);
+        memcpy(J->str, sax->str, sax->len);
+        J->str[sax->len] = '\0';
+        break;
+
+    case JSON_SAX_INT:
+    case JSON_SAX_FLOAT:
+        if (p->flags & JSON_STRNUM_FLAG) {
+            J->type = JSON_STRNUM;
+            J->strnum = jsonParserAlloc(p, sax->len + 1);
+            memcpy(J->strnum, sax->str, sax->len);
+            J->strnum[sax->len] = '\0';
+        } else if (sax->event == JSON_SAX_INT) {
+            J->type = JSON_INT;
+            J->integer = sax->integer;
+        } else {
+            J->type = JSON_FLOAT;
+            J->floating = sax->floating;
+        }
+        break;
+
+    case JSON_SAX_BOOL:
+        J->type = JSON_BOOL;
+        J->boolean = sax->boolean;
+        break;
+
+    default:
+        J->type = JSON_NULL;
+        break;
+    }
+
+    return 1;
+}
+
+/**
+ * Create a parser that is fed a document with `jsonPushParserFeed` and
+ * produces the tree with `jsonPushParserFinish`, flags are as for
+ * `jsonParseWithFlags`
+ */
+jsonPushParser *jsonPushParserNew(int flags) {
+    jsonPushParser *pp = malloc(sizeof(jsonPushParser));
+    jsonParserInit(&pp->p, NULL, 0);
+    pp->p.flags = flags;
+    pp->root = NULL;
+    pp->sax = jsonSaxNew(jsonPushParserEvent, pp);
+    return pp;
+}
+
+/* Returns JSON_OK or the first error encountered */
+int jsonPushParserFeed(jsonPushParser *pp, char *chunk, size_t len) {
+    return jsonSaxFeed(pp->sax, chunk, len);
+}
+
+/**
+ * There is no more input, hands over the tree which, like `jsonParse`, should
+ * be checked with `jsonOk`. The parser is ready for another document.
+ */
+json *jsonPushParserFinish(jsonPushParser *pp) {
+    jsonSax *sax = pp->sax;
+    json *J;
+
+    jsonSaxFinish(sax);
+    if ((J = pp->root) == NULL) {
+        J = jsonNew(&pp->p);
+    }
+
+    J->state = jsonStateNew(&pp->p);
+    J->state->error = sax->error;
+    J->state->ch = sax->ch;
+    J->state->offset = sax->offset;
+
+    pp->root = NULL;
+    jsonSaxReset(sax);
+    return J;
+}
+
+void jsonPushParserRelease(jsonPushParser *pp) {
+    if (pp) {
+        /* An unfinished document */
+        jsonRelease(pp->root);
+        jsonSaxRelease(pp->sax);
+        free(pp);
+    }
+}
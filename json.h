@@ -31,10 +31,16 @@ typedef enum JSON_DATA_TYPE {
     JSON_NULL,
 } JSON_DATA_TYPE;
 
+/* Bump allocator a parse tree can be carved out of, see `jsonParseWithArena`
+ */
+typedef struct jsonArena jsonArena;
+
 typedef struct jsonState {
     int error;
     char ch;
     size_t offset;
+    jsonArena *arena; /* Everything in the tree was allocated from here */
+    int owns_arena;   /* Released with the tree, otherwise reset */
 } jsonState;
 
 typedef struct json json;
@@ -73,8 +79,72 @@ typedef enum JSON_ERRNO {
     JSON_INVALID_ARRAY_CHARACTER,
     JSON_INVALID_ESCAPE_CHARACTER,
     JSON_EOF,
+    JSON_SAX_LIMIT,
 } JSON_ERRNO;
 
+/* SAX parsing, see `jsonSaxParse` */
+#define JSON_SAX_MAX_DEPTH (64)
+#define JSON_SAX_MAX_KEYS  (1024) /* Combined length of the keys on the path */
+
+typedef enum JSON_SAX_EVENT {
+    JSON_SAX_OBJECT_START,
+    JSON_SAX_OBJECT_END,
+    JSON_SAX_ARRAY_START,
+    JSON_SAX_ARRAY_END,
+    JSON_SAX_STRING,
+    JSON_SAX_INT,
+    JSON_SAX_FLOAT,
+    JSON_SAX_BOOL,
+    JSON_SAX_NULL,
+} JSON_SAX_EVENT;
+
+/* A container on the path to the current value */
+typedef struct jsonSaxFrame {
+    JSON_DATA_TYPE type; /* JSON_OBJECT or JSON_ARRAY */
+    int index;           /* Array index of the current value */
+    char *key;           /* Object key of the current value, NUL terminated */
+    size_t key_len;
+} jsonSaxFrame;
+
+typedef struct jsonSax jsonSax;
+
+/* Called for every event, return 0 to stop parsing */
+typedef int jsonSaxCallback(jsonSax *sax, void *privdata);
+
+typedef struct jsonSax {
+    JSON_SAX_EVENT event;
+    /* Value of the current event */
+    const char *str; /* Not NUL terminated, only valid during the callback */
+    size_t len;
+    ssize_t integer;
+    double floating;
+    int boolean;
+
+    /* Path to the current value, stack[0] is the outermost container. For
+     * START and END events this is the path to the container itself */
+    int depth;
+    jsonSaxFrame stack[JSON_SAX_MAX_DEPTH];
+    char keys[JSON_SAX_MAX_KEYS];
+
+    JSON_ERRNO error;
+    char ch;       /* Character at the offset of the error */
+    size_t offset; /* Into the document, not the chunk */
+
+    /* Where the parser is between calls to `jsonSaxFeed` */
+    int state;
+    int token;       /* Kind of token split across chunks */
+    int escaped;     /* The split token ended on a '\\' */
+    int stopped;     /* By the callback */
+    size_t consumed; /* Bytes fed before the current chunk */
+    struct jsonString *carry;   /* Split token */
+    struct jsonString *scratch; /* Decoded strings with escapes */
+    jsonSaxCallback *callback;
+    void *privdata;
+} jsonSax;
+
+/* Builds a tree from a document fed in chunks, see `jsonPushParserNew` */
+typedef struct jsonPushParser jsonPushParser;
+
 json *jsonGetObject(json *J);
 json *jsonGetArray(json *J);
 void *jsonGetNull(json *J);
@@ -95,8 +165,27 @@ json *jsonParse(char *raw_json);
 json *jsonParseWithFlags(char *raw_json, int flags);
 json *jsonParseWithLen(char *raw_json, size_t buflen);
 json *jsonParseWithLenAndFlags(char *raw_json, size_t buflen, int flags);
+json *jsonParseWithArena(char *raw_json, size_t buflen, int flags,
+                         jsonArena *arena);
 void jsonRelease(json *J);
 
+jsonSax *jsonSaxNew(jsonSaxCallback *callback, void *privdata);
+void jsonSaxReset(jsonSax *sax);
+void jsonSaxRelease(jsonSax *sax);
+int jsonSaxFeed(jsonSax *sax, char *chunk, size_t len);
+int jsonSaxFinish(jsonSax *sax);
+int jsonSaxParse(jsonSax *sax, char *raw_json, size_t buflen);
+void jsonSaxPrintError(jsonSax *sax);
+
+jsonPushParser *jsonPushParserNew(int flags);
+int jsonPushParserFeed(jsonPushParser *pp, char *chunk, size_t len);
+json *jsonPushParserFinish(jsonPushParser *pp);
+void jsonPushParserRelease(jsonPushParser *pp);
+
+jsonArena *jsonArenaNew(size_t block_size);
+void jsonArenaReset(jsonArena *arena);
+void jsonArenaRelease(jsonArena *arena);
+
 int jsonGetError(json *j);
 char *jsonGetStrerror(json *J);
 void jsonPrintError(json *J);
@@ -48,9 +48,6 @@
  * - Filter bogus Ctrl+<char> combinations.
  * - Win32 support
  *
- * Bloat:
- * - History search like Ctrl+r in readline?
- *
  * List of escape sequences used by this program, we do everything just
  * with three sequences. In order to be so cheap we may have some
  * flickering effect with some slow terminal, but the lesser sequences
@@ -111,14 +108,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "linenoise.h"
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
 #define LINENOISE_MAX_LINE 4096
+/* The journal is compacted once it holds this many times the max length */
+#define LINENOISE_HISTORY_COMPACT_FACTOR 2
+/* Buckets the trigram index of the history starts with */
+#define LINENOISE_INDEX_INITIAL_SIZE 1024
 static char *unsupported_term[] = {"dumb","cons25","emacs",NULL};
 static linenoiseCompletionCallback *completionCallback = NULL;
 static linenoiseHintsCallback *hintsCallback = NULL;
@@ -135,6 +138,34 @@ static int atexit_registered = 0; /* Register atexit just 1 time. */
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
 static char **history = NULL;
+static int history_fd = -1;         /* Journal opened by linenoiseHistoryOpen() */
+static char *history_file = NULL;   /* Path of the journal */
+static int history_file_lines = 0;  /* Entries in the journal, including the
+                                       ones since dropped from 'history' */
+static char typeahead[LINENOISE_MAX_LINE]; /* See linenoiseTypeahead() */
+static size_t typeahead_len = 0;
+static size_t typeahead_pos = 0;
+
+/* Every entry added to the history gets an id one more than the last, so
+ * the entry with id 'n' is history[n-history_first_id] for as long as it is
+ * in the history. The index maps each trigram, three consecutive bytes, to
+ * the ids of the entries it appears in, oldest first. Ids of entries that
+ * have since been dropped or edited are skipped when searching and go once
+ * the index is rebuilt. */
+typedef struct historyPosting {
+    unsigned int trigram;
+    long *ids;
+    int len;
+    int cap;
+    struct historyPosting *next; /* In the same bucket */
+} historyPosting;
+
+static historyPosting **history_trigrams = NULL;
+static unsigned long history_trigrams_size = 0;  /* Buckets, a power of 2 */
+static unsigned long history_trigrams_count = 0; /* Trigrams */
+static int history_trigrams_stale = 0; /* Entries dropped or edited since the
+                                          last build */
+static long history_first_id = 0;      /* Id of history[0] */
 
 enum KEY_ACTION{
 	KEY_NULL = 0,	    /* NULL */
@@ -144,6 +175,7 @@ enum KEY_ACTION{
 	CTRL_D = 4,         /* Ctrl-d */
 	CTRL_E = 5,         /* Ctrl-e */
 	CTRL_F = 6,         /* Ctrl-f */
+	CTRL_G = 7,         /* Ctrl-g */
 	CTRL_H = 8,         /* Ctrl-h */
 	TAB = 9,            /* Tab */
 	CTRL_K = 11,        /* Ctrl+k */
@@ -151,6 +183,7 @@ enum KEY_ACTION{
 	ENTER = 13,         /* Enter */
 	CTRL_N = 14,        /* Ctrl-n */
 	CTRL_P = 16,        /* Ctrl-p */
+	CTRL_R = 18,        /* Ctrl-r */
 	CTRL_T = 20,        /* Ctrl-t */
 	CTRL_U = 21,        /* Ctrl+u */
 	CTRL_W = 23,        /* Ctrl+w */
@@ -159,6 +192,10 @@ enum KEY_ACTION{
 };
 
 static void linenoiseAtExit(void);
+static int historyAdd(const char *line, int journal);
+static int historySearch(const char *query, int from);
+static void historyIndexFree(void);
+static void historyReplace(int j, const char *line);
 int linenoiseHistoryAdd(const char *line);
 #define REFRESH_CLEAN (1<<0)    // Clean the old prompt from the screen
 #define REFRESH_WRITE (1<<1)    // Rewrite the prompt on the screen.
@@ -508,7 +545,7 @@ static void abFree(struct abuf *ab) {
  * to the right of the prompt. */
 void refreshShowHints(struct abuf *ab, struct linenoiseState *l, int plen) {
     char seq[64];
-    if (hintsCallback && plen+l->len < l->cols) {
+    if (hintsCallback && !l->in_search && plen+l->len < l->cols) {
         int color = -1, bold = 0;
         char *hint = hintsCallback(l->buf,&color,&bold);
         if (hint) {
@@ -788,8 +825,7 @@ void linenoiseEditHistoryNext(struct linenoiseState *l, int dir) {
     if (history_len > 1) {
         /* Update the current history entry before to
          * overwrite it with the next one. */
-        free(history[history_len - 1 - l->history_index]);
-        history[history_len - 1 - l->history_index] = strdup(l->buf);
+        historyReplace(history_len - 1 - l->history_index, l->buf);
         /* Show the new entry */
         l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
         if (l->history_index < 0) {
@@ -806,6 +842,122 @@ void linenoiseEditHistoryNext(struct linenoiseState *l, int dir) {
     }
 }
 
+/* ============================ Reverse search ============================== */
+
+/* Show the match of the search, or the line as it was if there is none yet,
+ * behind a prompt with what is being searched for. */
+static void refreshSearch(struct linenoiseState *l) {
+    if (l->search_match >= 0) {
+        const char *match = history[l->search_match];
+        const char *found = strstr(match,l->search);
+
+        snprintf(l->buf,l->buflen,"%s",match);
+        l->len = strlen(l->buf);
+        l->pos = found ? (size_t)(found-match) : 0;
+        if (l->pos > l->len) l->pos = l->len;
+    }
+    snprintf(l->search_prompt,sizeof(l->search_prompt),"(%sreverse-i-search)`%s': ",
+        l->search_failed ? "failed " : "", l->search);
+    l->prompt = l->search_prompt;
+    l->plen = strlen(l->prompt);
+    refreshLine(l);
+}
+
+/* Look for the search from the history entry 'from' backwards, the current
+ * match is kept if nothing is found. */
+static void searchFrom(struct linenoiseState *l, int from) {
+    int match = historySearch(l->search,from);
+
+    if (match == -1) {
+        l->search_failed = 1;
+        linenoiseBeep();
+    } else {
+        l->search_failed = 0;
+        l->search_match = match;
+    }
+    refreshSearch(l);
+}
+
+/* Enter the reverse search, started by Ctrl-R. */
+static void searchStart(struct linenoiseState *l) {
+    l->in_search = 1;
+    l->search[0] = '\0';
+    l->search_len = 0;
+    l->search_match = -1;
+    l->search_failed = 0;
+    l->search_orig = strdup(l->buf);
+    l->search_orig_prompt = l->prompt;
+    refreshSearch(l);
+}
+
+/* Leave the reverse search, with the line as it was before the search if
+ * 'restore' is set, otherwise with the match. */
+static void searchStop(struct linenoiseState *l, int restore) {
+    if (restore && l->search_orig) {
+        snprintf(l->buf,l->buflen,"%s",l->search_orig);
+        l->len = l->pos = strlen(l->buf);
+    }
+    free(l->search_orig);
+    l->search_orig = NULL;
+    l->in_search = 0;
+    l->prompt = l->search_orig_prompt;
+    l->plen = strlen(l->prompt);
+    refreshLine(l);
+}
+
+/* This is an helper function for linenoiseEdit*() and is called for every
+ * key while in the reverse search, in the same way as completeLine(): if
+ * zero is returned the key was consumed by the search, otherwise the search
+ * is over and the key returned should be processed as usual.
+ *
+ * Typing narrows the search from the current match backwards, Ctrl-R moves
+ * on to the next older match, Ctrl-G and Ctrl-C give up on the search and
+ * any other key keeps the match as the line. */
+static int searchLine(struct linenoiseState *l, int keypressed) {
+    char c = keypressed;
+    /* The last entry is the line being edited */
+    int newest = history_len-2;
+
+    switch(c) {
+    case CTRL_R:
+        if (l->search_len == 0 || l->search_failed) {
+            linenoiseBeep();
+        } else {
+            searchFrom(l,l->search_match-1);
+        }
+        return 0;
+    case BACKSPACE:
+    case CTRL_H:
+        if (l->search_len > 0) {
+            l->search[--l->search_len] = '\0';
+            if (l->search_len == 0) {
+                l->search_failed = 0;
+                refreshSearch(l);
+            } else {
+                searchFrom(l,newest);
+            }
+        }
+        return 0;
+    case CTRL_G:
+    case CTRL_C:
+        searchStop(l,1);
+        return 0;
+    default:
+        if ((unsigned char)c < 32) {
+            searchStop(l,0);
+            return c;
+        }
+        if (l->search_len+1 < sizeof(l->search)) {
+            l->search[l->search_len++] = c;
+            l->search[l->search_len] = '\0';
+            searchFrom(l,l->search_match >= 0 ? l->search_match : newest);
+        } else {
+            linenoiseBeep();
+        }
+        return 0;
+    }
+}
+
 /* Delete the character at the right of the cursor without altering the cursor
  * position. Basically this is what happens with the "Delete" keyboard key. */
 void linenoiseEditDelete(struct linenoiseState *l) {
@@ -883,6 +1035,8 @@ int linenoiseEditStart(struct linenoiseState *l, int stdin_fd, int stdout_fd, ch
     l->cols = getColumns(stdin_fd, stdout_fd);
     l->oldrows = 0;
     l->history_index = 0;
+    l->in_search = 0;
+    l->search_orig = NULL;
 
     /* Buffer starts empty. */
     l->buf[0] = '\0';
@@ -898,12 +1052,34 @@ int linenoiseEditStart(struct linenoiseState *l, int stdin_fd, int stdout_fd, ch
 
     /* The latest history entry is always our current buffer, that
      * initially is just an empty string. */
-    linenoiseHistoryAdd("");
+    historyAdd("",0);
 
     if (write(l->ofd,prompt,l->plen) == -1) return -1;
     return 0;
 }
 
+/* Queue 'len' bytes of input to be read by linenoiseEditFeed() before
+ * anything else on the terminal. For keys the caller read while the line
+ * was not being edited, they are handled exactly as though typed at the
+ * prompt. Anything beyond LINENOISE_MAX_LINE bytes queued is dropped. */
+void linenoiseTypeahead(const char *buf, size_t len) {
+    if (typeahead_pos == typeahead_len)
+        typeahead_pos = typeahead_len = 0;
+    if (len > sizeof(typeahead)-typeahead_len)
+        len = sizeof(typeahead)-typeahead_len;
+    memcpy(typeahead+typeahead_len,buf,len);
+    typeahead_len += len;
+}
+
+/* Read a byte of input, the typeahead first. */
+static int readByte(int fd, char *c) {
+    if (typeahead_pos < typeahead_len) {
+        *c = typeahead[typeahead_pos++];
+        return 1;
+    }
+    return read(fd,c,1);
+}
+
 char *linenoiseEditMore = "If you see this, you are misusing the API: when linenoiseEditFeed() is called, if it returns linenoiseEditMore the user is yet editing the line. See the README file for more information.";
 
 /* This function is part of the multiplexed API of linenoise, see the top
@@ -933,9 +1109,15 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
     int nread;
     char seq[3];
 
-    nread = read(l->ifd,&c,1);
+    nread = readByte(l->ifd,&c);
     if (nread <= 0) return NULL;
 
+    /* Keys edit the search until one that is not part of it ends it. */
+    if (l->in_search) {
+        c = searchLine(l,c);
+        if (c == 0) return linenoiseEditMore;
+    }
+
     /* Only autocomplete when the callback is set. It returns < 0 when
      * there was an error reading from fd. Otherwise it will return the
      * character that should be handled next. */
@@ -1000,18 +1182,21 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
     case CTRL_N:    /* ctrl-n */
         linenoiseEditHistoryNext(l, LINENOISE_HISTORY_NEXT);
         break;
+    case CTRL_R:    /* ctrl-r, search the history backwards */
+        searchStart(l);
+        break;
     case ESC:    /* escape sequence */
         /* Read the next two bytes representing the escape sequence.
          * Use two calls to handle slow terminals returning the two
          * chars at different times. */
-        if (read(l->ifd,seq,1) == -1) break;
-        if (read(l->ifd,seq+1,1) == -1) break;
+        if (readByte(l->ifd,seq) == -1) break;
+        if (readByte(l->ifd,seq+1) == -1) break;
 
         /* ESC [ sequences. */
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
                 /* Extended escape, read additional byte. */
-                if (read(l->ifd,seq+2,1) == -1) break;
+                if (readByte(l->ifd,seq+2) == -1) break;
                 if (seq[2] == '~') {
                     switch(seq[1]) {
                     case '3': /* Delete key. */
@@ -1236,17 +1421,276 @@ static void freeHistory(void) {
 /* At exit we'll try to fix the terminal to the initial conditions. */
 static void linenoiseAtExit(void) {
     disableRawMode(STDIN_FILENO);
+    linenoiseHistoryClose();
+    historyIndexFree();
     freeHistory();
 }
 
+/* Free the trigram index of the history. */
+static void historyIndexFree(void) {
+    unsigned long j;
+
+    for (j = 0; j < history_trigrams_size; j++) {
+        historyPosting *p = history_trigrams[j];
+
+        while (p) {
+            historyPosting *next = p->next;
+            free(p->ids);
+            free(p);
+            p = next;
+        }
+    }
+    free(history_trigrams);
+    history_trigrams = NULL;
+    history_trigrams_size = history_trigrams_count = 0;
+}
+
+static unsigned long historyIndexHash(unsigned int trigram) {
+    return (trigram*2654435761u) & (history_trigrams_size-1);
+}
+
+/* Return the entries containing 'trigram', NULL if there are none. */
+static historyPosting *historyIndexFind(unsigned int trigram) {
+    historyPosting *p;
+
+    if (history_trigrams == NULL) return NULL;
+    p = history_trigrams[historyIndexHash(trigram)];
+    while (p && p->trigram != trigram)
+        p = p->next;
+    return p;
+}
+
+/* Double the buckets once there are more trigrams than buckets. */
+static int historyIndexGrow(void) {
+    historyPosting **old = history_trigrams;
+    unsigned long old_size = history_trigrams_size, j;
+
+    history_trigrams_size = old_size ? old_size*2 : LINENOISE_INDEX_INITIAL_SIZE;
+    history_trigrams = calloc(history_trigrams_size,sizeof(historyPosting*));
+    if (history_trigrams == NULL) {
+        history_trigrams = old;
+        history_trigrams_size = old_size;
+        return -1;
+    }
+    for (j = 0; j < old_size; j++) {
+        historyPosting *p = old[j];
+
+        while (p) {
+            historyPosting *next = p->next;
+            unsigned long bucket = historyIndexHash(p->trigram);
+
+            p->next = history_trigrams[bucket];
+            history_trigrams[bucket] = p;
+            p = next;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* Add the entry 'id' to the postings of every trigram in 'line', keeping
+ * each list in order. A new entry has the highest id so far and goes at the
+ * tail, an entry edited in place keeps its older id and is put where it
+ * belongs unless it is already there. */
+static void historyIndexEntry(long id, const char *line) {
+    const unsigned char *p = (const unsigned char*)line;
+    size_t len = strlen(line), j;
+    int pos;
+
+    for (j = 0; j+2 < len; j++) {
+        unsigned int trigram = (p[j]<<16)|(p[j+1]<<8)|p[j+2];
+        historyPosting *posting = historyIndexFind(trigram);
+
+        if (posting == NULL) {
+            unsigned long bucket;
+
+            if (history_trigrams_count >= history_trigrams_size &&
+                historyIndexGrow() == -1 && history_trigrams == NULL) return;
+            posting = calloc(1,sizeof(*posting));
+            if (posting == NULL) return;
+            posting->trigram = trigram;
+            bucket = historyIndexHash(trigram);
+            posting->next = history_trigrams[bucket];
+            history_trigrams[bucket] = posting;
+            history_trigrams_count++;
+        }
+        pos = posting->len;
+        if (pos && posting->ids[pos-1] >= id) {
+            int lo = 0, hi = posting->len;
+
+            while (lo < hi) {
+                int mid = lo+(hi-lo)/2;
+
+                if (posting->ids[mid] < id)
+                    lo = mid+1;
+                else
+                    hi = mid;
+            }
+            if (posting->ids[lo] == id) continue;
+            pos = lo;
+        }
+        if (posting->len == posting->cap) {
+            int cap = posting->cap ? posting->cap*2 : 4;
+            long *ids = realloc(posting->ids,sizeof(long)*cap);
+
+            if (ids == NULL) return;
+            posting->ids = ids;
+            posting->cap = cap;
+        }
+        memmove(posting->ids+pos+1,posting->ids+pos,
+                sizeof(long)*(posting->len-pos));
+        posting->ids[pos] = id;
+        posting->len++;
+    }
+}
+
+/* Throw the index away and index what is in the history now. */
+static void historyIndexBuild(void) {
+    int j;
+
+    historyIndexFree();
+    for (j = 0; j < history_len; j++)
+        historyIndexEntry(history_first_id+j,history[j]);
+    history_trigrams_stale = 0;
+}
+
+/* Replace history['j'] with a copy of 'line', as when a recalled entry is
+ * edited, and index it under the same id. What only the old text had is
+ * left in the index, the search compares every entry it finds with the
+ * query anyway, until enough has gone stale to rebuild it. */
+static void historyReplace(int j, const char *line) {
+    char *linecopy;
+
+    if (!strcmp(history[j],line)) return;
+    linecopy = strdup(line);
+    if (linecopy == NULL) return;
+    free(history[j]);
+    history[j] = linecopy;
+    historyIndexEntry(history_first_id+j,linecopy);
+    if (++history_trigrams_stale >= history_max_len) historyIndexBuild();
+}
+
+/* Return the newest entry at or before history['from'] that contains
+ * 'query', or -1 if none do.
+ *
+ * Only the entries holding the rarest trigram of the query are compared
+ * with it, if a trigram of the query is in no entry there is no need to
+ * look at all. A query too short to have a trigram is looked for in
+ * every entry. */
+static int historySearch(const char *query, int from) {
+    const unsigned char *q = (const unsigned char*)query;
+    size_t qlen = strlen(query), j;
+    historyPosting *rarest = NULL;
+    int lo, hi;
+
+    if (from >= history_len) from = history_len-1;
+    if (qlen < 3) {
+        for (; from >= 0; from--) {
+            if (strstr(history[from],query)) return from;
+        }
+        return -1;
+    }
+
+    for (j = 0; j+2 < qlen; j++) {
+        unsigned int trigram = (q[j]<<16)|(q[j+1]<<8)|q[j+2];
+        historyPosting *posting = historyIndexFind(trigram);
+
+        if (posting == NULL) return -1;
+        if (rarest == NULL || posting->len < rarest->len) rarest = posting;
+    }
+
+    /* Find the last id at or before 'from' and walk back from there. */
+    lo = 0;
+    hi = rarest->len;
+    while (lo < hi) {
+        int mid = lo+(hi-lo)/2;
+
+        if (rarest->ids[mid] <= history_first_id+from)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    while (--lo >= 0) {
+        long id = rarest->ids[lo];
+
+        if (id < history_first_id) break;
+        if (strstr(history[id-history_first_id],query))
+            return id-history_first_id;
+    }
+    return -1;
+}
+
+/* Rewrite the journal with just what is in memory. The new file is written
+ * next to the old one and renamed over it, so a crash half way leaves the
+ * old journal in place. On success 0 is returned otherwise -1 is returned. */
+static int historyCompact(void) {
+    mode_t old_umask;
+    size_t len = strlen(history_file)+5;
+    char *tmp = malloc(len);
+    FILE *fp;
+    int fd, j;
+
+    if (tmp == NULL) return -1;
+    snprintf(tmp,len,"%s.tmp",history_file);
+    old_umask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
+    fp = fopen(tmp,"w");
+    umask(old_umask);
+    if (fp == NULL) {
+        free(tmp);
+        return -1;
+    }
+    for (j = 0; j < history_len; j++)
+        fprintf(fp,"%s\n",history[j]);
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+        fclose(fp);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp,history_file) == -1) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+
+    /* The old descriptor still points at the file that was replaced. */
+    fd = open(history_file,O_RDWR|O_APPEND|O_CREAT,S_IRUSR|S_IWUSR);
+    if (fd == -1) return -1;
+    close(history_fd);
+    history_fd = fd;
+    history_file_lines = history_len;
+    return 0;
+}
+
+/* Append 'line' to the journal with a single write, compacting it if it
+ * has grown well past the max length of the history. */
+static void historyJournal(const char *line) {
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void*)line;
+    iov[0].iov_len = strlen(line);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    if (writev(history_fd,iov,2) == -1) return;
+    history_file_lines++;
+    if (history_file_lines >=
+            history_max_len*LINENOISE_HISTORY_COMPACT_FACTOR)
+        historyCompact();
+}
+
 /* This is the API call to add a new entry in the linenoise history.
  * It uses a fixed array of char pointers that are shifted (memmoved)
  * when the history max length is reached in order to remove the older
  * entry and make room for the new one, so it is not exactly suitable for huge
  * histories, but will work well for a few hundred of entries.
  *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-int linenoiseHistoryAdd(const char *line) {
+ * Using a circular buffer is smarter, but a bit more complex to handle.
+ *
+ * Only when 'journal' is set is the entry appended to the journal, the empty
+ * entry standing in for the line being edited is not. */
+static int historyAdd(const char *line, int journal) {
     char *linecopy;
 
     if (history_max_len == 0) return 0;
@@ -1269,12 +1713,27 @@ int linenoiseHistoryAdd(const char *line) {
         free(history[0]);
         memmove(history,history+1,sizeof(char*)*(history_max_len-1));
         history_len--;
+        history_first_id++;
+        history_trigrams_stale++;
     }
     history[history_len] = linecopy;
     history_len++;
+
+    /* Once as many entries have gone as the history holds, rebuild the
+     * index rather than let the ids of the dropped ones pile up. */
+    if (history_trigrams_stale >= history_max_len) {
+        historyIndexBuild();
+    } else {
+        historyIndexEntry(history_first_id+history_len-1,linecopy);
+    }
+    if (journal && history_fd != -1) historyJournal(linecopy);
     return 1;
 }
 
+int linenoiseHistoryAdd(const char *line) {
+    return historyAdd(line,1);
+}
+
 /* Set the maximum length for the history. This function can be called even
  * if there is already some history, the function will make sure to retain
  * just the latest 'len' elements if the new history length value is smaller
@@ -1294,6 +1753,7 @@ int linenoiseHistorySetMaxLen(int len) {
             int j;
 
             for (j = 0; j < tocopy-len; j++) free(history[j]);
+            history_first_id += tocopy-len;
             tocopy = len;
         }
         memset(new,0,sizeof(char*)*len);
@@ -1304,6 +1764,7 @@ int linenoiseHistorySetMaxLen(int len) {
     history_max_len = len;
     if (history_len > history_max_len)
         history_len = history_max_len;
+    historyIndexBuild();
     return 1;
 }
 
@@ -1324,6 +1785,23 @@ int linenoiseHistorySave(const char *filename) {
     return 0;
 }
 
+/* Load the history from 'fp', returning how many lines were read. */
+static int historyLoad(FILE *fp) {
+    char buf[LINENOISE_MAX_LINE];
+    int lines = 0;
+
+    while (fgets(buf,LINENOISE_MAX_LINE,fp) != NULL) {
+        char *p;
+
+        p = strchr(buf,'\r');
+        if (!p) p = strchr(buf,'\n');
+        if (p) *p = '\0';
+        historyAdd(buf,0);
+        lines++;
+    }
+    return lines;
+}
+
 /* Load the history from the specified file. If the file does not exist
  * zero is returned and no operation is performed.
  *
@@ -1331,18 +1809,71 @@ int linenoiseHistorySave(const char *filename) {
  * on error -1 is returned. */
 int linenoiseHistoryLoad(const char *filename) {
     FILE *fp = fopen(filename,"r");
-    char buf[LINENOISE_MAX_LINE];
 
     if (fp == NULL) return -1;
+    historyLoad(fp);
+    fclose(fp);
+    return 0;
+}
 
-    while (fgets(buf,LINENOISE_MAX_LINE,fp) != NULL) {
-        char *p;
+/* Load the history from the specified file and keep it open as a journal:
+ * from now on every entry added to the history is appended to the file as
+ * it is added, rather than the whole history being rewritten with
+ * linenoiseHistorySave(). Entries pushed out of the history stay in the
+ * file until it holds LINENOISE_HISTORY_COMPACT_FACTOR times the max length,
+ * then it is rewritten with just the history.
+ *
+ * The file is created if it does not exist. On success 0 is returned
+ * otherwise -1 is returned. */
+int linenoiseHistoryOpen(const char *filename) {
+    mode_t old_umask;
+    FILE *fp;
+    off_t size;
+    int fd;
 
-        p = strchr(buf,'\r');
-        if (!p) p = strchr(buf,'\n');
-        if (p) *p = '\0';
-        linenoiseHistoryAdd(buf);
+    linenoiseHistoryClose();
+    old_umask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
+    fd = open(filename,O_RDWR|O_APPEND|O_CREAT,S_IRUSR|S_IWUSR);
+    umask(old_umask);
+    if (fd == -1) return -1;
+    history_file = strdup(filename);
+    if (history_file == NULL) {
+        close(fd);
+        return -1;
     }
-    fclose(fp);
+
+    /* Loaded before the journal is set, so nothing is appended twice. */
+    fp = fopen(filename,"r");
+    if (fp) {
+        history_file_lines = historyLoad(fp);
+        fclose(fp);
+    }
+    history_fd = fd;
+
+    /* A write cut short would glue the next entry onto the last one. */
+    size = lseek(fd,0,SEEK_END);
+    if (size > 0) {
+        char c;
+
+        if (pread(fd,&c,1,size-1) == 1 && c != '\n' &&
+            write(fd,"\n",1) == -1) {
+            linenoiseHistoryClose();
+            return -1;
+        }
+    }
+    if (history_file_lines >=
+            history_max_len*LINENOISE_HISTORY_COMPACT_FACTOR)
+        historyCompact();
     return 0;
 }
+
+/* Stop journaling the history, what is in memory is kept. */
+void linenoiseHistoryClose(void) {
+    if (history_fd != -1) {
+        close(history_fd);
+        history_fd = -1;
+    }
+    free(history_file);
+    history_file = NULL;
+    history_file_lines = 0;
+}
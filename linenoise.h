@@ -45,6 +45,8 @@ extern "C" {
 
 #include <stddef.h> /* For size_t. */
 
+#define LINENOISE_SEARCH_MAX 256 /* Longest Ctrl-R search. */
+
 extern char *linenoiseEditMore;
 
 /* The linenoiseState structure represents the state during line editing.
@@ -66,6 +68,15 @@ struct linenoiseState {
     size_t cols;        /* Number of columns in terminal. */
     size_t oldrows;     /* Rows used by last refrehsed line (multiline mode) */
     int history_index;  /* The history index we are currently editing. */
+    int in_search;      /* The user pressed Ctrl-R and we are now in reverse
+                         * search mode, so input is handled by searchLine(). */
+    char search[LINENOISE_SEARCH_MAX]; /* What is being searched for. */
+    size_t search_len;  /* Length of the search. */
+    int search_match;   /* History index of the match, -1 if none. */
+    int search_failed;  /* Nothing matches what has been typed. */
+    char *search_orig;  /* The line before the search, put back on Ctrl-G. */
+    const char *search_orig_prompt; /* The prompt before the search. */
+    char search_prompt[LINENOISE_SEARCH_MAX+32]; /* Shown during the search. */
 };
 
 typedef struct linenoiseCompletions {
@@ -79,6 +90,7 @@ char *linenoiseEditFeed(struct linenoiseState *l);
 void linenoiseEditStop(struct linenoiseState *l);
 void linenoiseHide(struct linenoiseState *l);
 void linenoiseShow(struct linenoiseState *l);
+void linenoiseTypeahead(const char *buf, size_t len);
 
 /* Blocking API. */
 char *linenoise(const char *prompt);
@@ -98,6 +110,8 @@ int linenoiseHistoryAdd(const char *line);
 int linenoiseHistorySetMaxLen(int len);
 int linenoiseHistorySave(const char *filename);
 int linenoiseHistoryLoad(const char *filename);
+int linenoiseHistoryOpen(const char *filename);
+void linenoiseHistoryClose(void);
 
 /* Other utilities. */
 void linenoiseClearScreen(void);
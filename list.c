@@ -26,6 +26,22 @@ void listAppend(list *l, void *data) {
     l->prev = node;
 }
 
+/* Remove the last node from the list returning its value, NULL if empty */
+void *listPop(list *l) {
+    list *tail = l->prev;
+    void *value;
+
+    if (tail == l) {
+        return NULL;
+    }
+
+    value = tail->value;
+    tail->prev->next = l;
+    l->prev = tail->prev;
+    free(tail);
+    return value;
+}
+
 void listRelease(list *l, void (*freevalue)(void *)) {
     if (l) {
         list *head = l;
@@ -16,5 +16,6 @@ typedef struct list {
 list *listNew(void);
 void listRelease(list *l, void (*freevalue)(void *));
 void listAppend(list *l, void *value);
+void *listPop(list *l);
 
 #endif // !__LIST_H
@@ -60,8 +60,29 @@ char *getApiKey(void) {
 int main(void) {
     char *apikey = getApiKey();
     openAiCtx *ctx = openAiCtxNew(apikey, "gpt-3.5-turbo", NULL);
+    char *durability, *cache_ttl;
+    int mode, ttl;
 
     openAiCtxSetFlags(ctx, (OPEN_AI_FLAG_HISTORY | OPEN_AI_FLAG_STREAM));
+    if ((durability = getenv("OPENAI_DB_DURABILITY")) != NULL) {
+        if ((mode = sqlDurabilityFromName(durability)) == -1) {
+            warning("OPENAI_DB_DURABILITY should be one of safe, balanced "
+                    "or fast, got: %s\n", durability);
+        } else {
+            openAiCtxSetDurability(ctx, mode);
+        }
+    }
     openAiCtxDbInit(ctx);
+    openAiCtxTokenizerInit(ctx);
+    /* Off unless asked for, a replayed answer ignores the temperature */
+    if ((cache_ttl = getenv("OPENAI_CACHE_TTL")) != NULL) {
+        if ((ttl = atoi(cache_ttl)) < 0) {
+            warning("OPENAI_CACHE_TTL should be a number of seconds, got: %s\n",
+                    cache_ttl);
+        } else {
+            openAiCtxSetCache(ctx, ttl, OPEN_AI_CACHE_MAX);
+        }
+    }
     cliMain(ctx);
+    openAiCtxDbClose(ctx);
 }
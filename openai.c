@@ -10,9 +10,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "aostr.h"
+#include "bpe.h"
+#include "hash.h"
 #include "http.h"
 #include "json-selector.h"
 #include "json.h"
@@ -21,6 +24,31 @@
 #include "panic.h"
 #include "sql.h"
 
+/* Byte pair encoding tables, looked for in the home directory unless
+ * OPENAI_BPE_FILE is set */
+#define OPEN_AI_BPE_FILE "chatgpt-cli-cl100k_base.tiktoken"
+
+/* Context windows by model, the first prefix that matches wins so more
+ * specific names come first */
+static struct {
+    char *prefix;
+    size_t context_window;
+} open_ai_context_windows[] = {
+        {"gpt-4o", 128000},
+        {"gpt-4-turbo", 128000},
+        {"gpt-4-1106", 128000},
+        {"gpt-4-0125", 128000},
+        {"gpt-4-32k", 32768},
+        {"gpt-4", 8192},
+        {"gpt-3.5-turbo-16k", 16385},
+        {"gpt-3.5-turbo-1106", 16385},
+        {"gpt-3.5-turbo-0125", 16385},
+        {"gpt-3.5-turbo", 4096},
+};
+
+static void openAiCtxWindowReset(openAiCtx *ctx);
+static void openAiCtxWindowPush(openAiCtx *ctx, list *node);
+
 char *role_to_str[] = {
         [OPEN_AI_ROLE_USER] = "user",
         [OPEN_AI_ROLE_ASSISTANT] = "assistant",
@@ -62,14 +90,19 @@ openAiCtx *openAiCtxNew(char *apikey, char *model, char *organisation) {
     ctx->apikey = strdup(apikey);
     ctx->organisation = organisation ? strdup(organisation) : NULL;
     ctx->model = strdup(model);
+    ctx->context_window = openAiModelContextWindow(model);
 
     ctx->auth_headers = openAiAuthHeaders(ctx);
 
     /* History */
     ctx->chat_len = 0;
     ctx->chat = listNew();
+    ctx->messages = aoStrAlloc(4096);
+    aoStrSetLen(ctx->messages, 0);
 
     ctx->db = NULL;
+    ctx->durability = SQL_DURABILITY_BALANCED;
+    ctx->writer = NULL;
 
     ctx->top_p = 0;
     ctx->n = 0;
@@ -77,7 +110,21 @@ openAiCtx *openAiCtxNew(char *apikey, char *model, char *organisation) {
     ctx->presence_penalty = 0;
     ctx->max_tokens = 0;
     ctx->flags = 0;
-    ctx->tmp_buffer = aoStrAlloc(512);
+    ctx->loop = httpLoopNew();
+    ctx->render = renderNew(stdout, RENDER_FRAME_MS);
+    ctx->stream = NULL;
+    ctx->stream_content = jsonSelectorCompile(".choices[0].delta.content:s");
+    ctx->tokenizer = NULL;
+
+    ctx->window = ctx->chat;
+    ctx->window_offset = 0;
+    ctx->window_tokens = 0;
+    ctx->pinned = aoStrAlloc(512);
+    aoStrSetLen(ctx->pinned, 0);
+    ctx->pinned_tokens = 0;
+
+    ctx->cache_ttl = 0;
+    ctx->cache_max = OPEN_AI_CACHE_MAX;
     return ctx;
 }
 
@@ -88,6 +135,14 @@ void openAiCtxPrint(openAiCtx *ctx) {
     printf("  n: %d\n", ctx->n);
     printf("  presence_penalty: %f\n", ctx->presence_penalty);
     printf("  max_tokens: %zu\n", ctx->max_tokens);
+    printf("  context_window: %zu\n", ctx->context_window);
+    printf("  history_budget: %zu\n", openAiCtxHistoryBudget(ctx));
+    printf("  durability: %s\n", sqlDurabilityName(ctx->durability));
+    printf("  render_frame_ms: %d\n", ctx->render->frame_ms);
+    printf("  render_markdown: %d\n", ctx->render->markdown);
+    printf("  cache_ttl: %d\n", ctx->cache_ttl);
+    printf("  cache_max: %zu\n", ctx->cache_max);
+    printf("  tokenizer: %s\n", ctx->tokenizer ? "bpe" : "estimate");
     printf("  temperature: %f\n", ctx->temperature);
     printf("  top_p: %f\n", ctx->top_p);
     printf("  flags: 0x%X\n", ctx->flags);
@@ -121,10 +176,37 @@ void openAiCtxHistoryPrint(openAiCtx *ctx) {
     }
 }
 
+/* Append the message as it appears in the "messages" array of a request, the
+ * content is already escaped */
+static void openAiCtxMessagesAppend(openAiCtx *ctx, openAiMessage *msg) {
+    size_t start = ctx->messages->len;
+
+    aoStrCatLen(ctx->messages, "{\"role\": \"", 10);
+    aoStrCat(ctx->messages, role_to_str[msg->role]);
+    aoStrCatLen(ctx->messages, "\", \"content\": \"", 15);
+    aoStrCatLen(ctx->messages, msg->content->data, msg->content->len);
+    aoStrCatLen(ctx->messages, "\"},", 3);
+    msg->json_len = ctx->messages->len - start;
+}
+
+/* For when the whole of the history has been replaced */
+static void openAiCtxMessagesRebuild(openAiCtx *ctx) {
+    list *node = ctx->chat->next;
+
+    aoStrSetLen(ctx->messages, 0);
+    while (node != ctx->chat) {
+        openAiCtxMessagesAppend(ctx, node->value);
+        node = node->next;
+    }
+    openAiCtxWindowReset(ctx);
+}
+
 void openAiCtxHistoryClear(openAiCtx *ctx) {
     openAiMessageListRelease(ctx->chat);
     ctx->chat = listNew();
     ctx->chat_len = 0;
+    aoStrSetLen(ctx->messages, 0);
+    openAiCtxWindowReset(ctx);
 }
 
 void openAiChatHistoryAppend(openAiCtx *ctx, int role, char *name,
@@ -133,8 +215,13 @@ void openAiChatHistoryAppend(openAiCtx *ctx, int role, char *name,
     msg->name = name;
     msg->role = role;
     msg->content = data;
+    msg->tokens = -1;
+    msg->persisted = 0;
+    msg->saving = 0;
     listAppend(ctx->chat, msg);
     ctx->chat_len++;
+    openAiCtxMessagesAppend(ctx, msg);
+    openAiCtxWindowPush(ctx, ctx->chat->prev);
 }
 
 void openAiCtxRelease(openAiCtx *ctx) {
@@ -148,6 +235,13 @@ void openAiCtxRelease(openAiCtx *ctx) {
     free(ctx->model);
     listRelease(ctx->auth_headers, (void (*)(void *))aoStrRelease);
     openAiMessageListRelease(ctx->chat);
+    aoStrRelease(ctx->messages);
+    aoStrRelease(ctx->pinned);
+    httpLoopRelease(ctx->loop);
+    renderRelease(ctx->render);
+    jsonSelectorRelease(ctx->stream_content);
+    bpeRelease(ctx->tokenizer);
+    openAiCtxDbClose(ctx);
     free(ctx);
 }
 
@@ -163,6 +257,8 @@ void openAiCtxSetModel(openAiCtx *ctx, char *model) {
         free(ctx->model);
     }
     ctx->model = strdup(model);
+    ctx->context_window = openAiModelContextWindow(model);
+    openAiCtxWindowReset(ctx);
 }
 
 void openAiCtxSetN(openAiCtx *ctx, int n) {
@@ -175,6 +271,7 @@ void openAiCtxSetPresencePenalty(openAiCtx *ctx, float presence_penalty) {
 
 void openAiCtxSetMaxTokens(openAiCtx *ctx, size_t max_tokens) {
     ctx->max_tokens = max_tokens;
+    openAiCtxWindowReset(ctx);
 }
 
 void openAiCtxSetTemperature(openAiCtx *ctx, float temperature) {
@@ -187,6 +284,7 @@ void openAiCtxSetTopP(openAiCtx *ctx, float top_p) {
 
 void openAiCtxSetChatHistory(openAiCtx *ctx, list *chat) {
     ctx->chat = chat;
+    openAiCtxMessagesRebuild(ctx);
 }
 
 void openAiCtxSetChatLen(openAiCtx *ctx, size_t history_len) {
@@ -197,6 +295,283 @@ void openAiCtxSetFlags(openAiCtx *ctx, int flags) {
     ctx->flags |= flags;
 }
 
+void openAiCtxSetContextWindow(openAiCtx *ctx, size_t context_window) {
+    ctx->context_window = context_window;
+    openAiCtxWindowReset(ctx);
+}
+
+/* 0 writes each token of a streamed answer as it arrives */
+void openAiCtxSetRenderFrame(openAiCtx *ctx, int frame_ms) {
+    renderSetFrame(ctx->render, frame_ms);
+}
+
+void openAiCtxSetRenderMarkdown(openAiCtx *ctx, int markdown) {
+    renderSetMarkdown(ctx->render, markdown);
+}
+
+void openAiCtxSetDurability(openAiCtx *ctx, SqlDurability durability) {
+    ctx->durability = durability;
+}
+
+void openAiCtxSetCache(openAiCtx *ctx, int ttl, size_t max_bytes) {
+    ctx->cache_ttl = ttl;
+    ctx->cache_max = max_bytes;
+}
+
+/*=============================================================================
+ * Token counting
+ *============================================================================*/
+
+/* Load the tables from OPENAI_BPE_FILE or the home directory, without them
+ * token counts are estimated */
+void openAiCtxTokenizerInit(openAiCtx *ctx) {
+    char *path = getenv("OPENAI_BPE_FILE");
+    aoStr *home_path = NULL;
+    struct passwd *pw;
+
+    if (path == NULL) {
+        if ((pw = getpwuid(getuid())) == NULL) {
+            return;
+        }
+        home_path = aoStrAlloc(512);
+        aoStrCatPrintf(home_path, "%s/.%s", pw->pw_dir, OPEN_AI_BPE_FILE);
+        path = home_path->data;
+    }
+
+    /* Not having the tables is not an error */
+    if (access(path, R_OK) == 0) {
+        openAiCtxSetTokenizer(ctx, path);
+    }
+    aoStrRelease(home_path);
+}
+
+/* Returns 1 if the tables at 'path' were loaded */
+int openAiCtxSetTokenizer(openAiCtx *ctx, char *path) {
+    bpe *tokenizer = bpeLoad(path);
+    list *node;
+
+    if (tokenizer == NULL) {
+        return 0;
+    }
+
+    bpeRelease(ctx->tokenizer);
+    ctx->tokenizer = tokenizer;
+    /* Counts made with the old tables are stale */
+    node = ctx->chat->next;
+    while (node != ctx->chat) {
+        ((openAiMessage *)node->value)->tokens = -1;
+        node = node->next;
+    }
+    openAiCtxWindowReset(ctx);
+    return 1;
+}
+
+/* Undo the escaping of a string held for a json payload, 'dst' must be at
+ * least 'len' bytes as nothing decodes to more than its escaped form */
+static size_t openAiUnescape(const char *src, size_t len, char *dst) {
+    const char *end = src + len;
+    unsigned int cp;
+    size_t out = 0;
+
+    while (src < end) {
+        if (*src != '\\' || src + 1 == end) {
+            dst[out++] = *src++;
+            continue;
+        }
+        src++;
+        switch (*src) {
+        case 'n':
+            dst[out++] = '\n';
+            break;
+        case 't':
+            dst[out++] = '\t';
+            break;
+        case 'r':
+            dst[out++] = '\r';
+            break;
+        case 'b':
+            dst[out++] = '\b';
+            break;
+        case 'f':
+            dst[out++] = '\f';
+            break;
+        case 'v':
+            dst[out++] = '\v';
+            break;
+        case 'u':
+            cp = 0;
+            for (int i = 1; i <= 4 && src + i < end; ++i) {
+                char ch = src[i];
+                cp <<= 4;
+                if (ch >= '0' && ch <= '9') {
+                    cp |= ch - '0';
+                } else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+                    cp |= (ch | 0x20) - 'a' + 10;
+                }
+            }
+            /* Only the utf-8 length matters when counting */
+            if (cp < 0x80) {
+                dst[out++] = cp;
+            } else if (cp < 0x800) {
+                dst[out++] = 0xC0 | (cp >> 6);
+                dst[out++] = 0x80 | (cp & 0x3F);
+            } else {
+                dst[out++] = 0xE0 | (cp >> 12);
+                dst[out++] = 0x80 | ((cp >> 6) & 0x3F);
+                dst[out++] = 0x80 | (cp & 0x3F);
+            }
+            src += end - src > 4 ? 4 : end - src - 1;
+            break;
+        default: /* '"', '\\' and '/' */
+            dst[out++] = *src;
+            break;
+        }
+        src++;
+    }
+    return out;
+}
+
+/* Tokens the raw 'text' encodes to */
+size_t openAiCtxCountTokens(openAiCtx *ctx, char *text, size_t len) {
+    return bpeCountTokens(ctx->tokenizer, text, len);
+}
+
+/* What the message costs in a prompt, counted once and then cached */
+int openAiMessageTokens(openAiCtx *ctx, openAiMessage *msg) {
+    char stack_buf[1024];
+    char *buf = stack_buf;
+    size_t len;
+
+    if (msg->tokens != -1) {
+        return msg->tokens;
+    }
+
+    /* History is kept escaped, count what the model will see */
+    if (msg->content->len > sizeof(stack_buf)) {
+        buf = malloc(msg->content->len);
+    }
+    len = openAiUnescape(msg->content->data, msg->content->len, buf);
+    msg->tokens = OPEN_AI_TOKENS_PER_MESSAGE +
+                  bpeCountTokens(ctx->tokenizer, buf, len) +
+                  bpeCountTokens(ctx->tokenizer, role_to_str[msg->role],
+                                 strlen(role_to_str[msg->role]));
+    if (buf != stack_buf) {
+        free(buf);
+    }
+    return msg->tokens;
+}
+
+/* Tokens the history costs when sent */
+size_t openAiCtxHistoryTokens(openAiCtx *ctx) {
+    list *node = ctx->chat->next;
+    size_t tokens = 0;
+
+    while (node != ctx->chat) {
+        tokens += openAiMessageTokens(ctx, node->value);
+        node = node->next;
+    }
+    return tokens;
+}
+
+/*=============================================================================
+ * Budgeting the history sent with a request
+ *============================================================================*/
+
+size_t openAiModelContextWindow(char *model) {
+    int len = sizeof(open_ai_context_windows) /
+              sizeof(open_ai_context_windows[0]);
+    for (int i = 0; i < len; ++i) {
+        char *prefix = open_ai_context_windows[i].prefix;
+        if (!strncmp(model, prefix, strlen(prefix))) {
+            return open_ai_context_windows[i].context_window;
+        }
+    }
+    return OPEN_AI_DEFAULT_CONTEXT_WINDOW;
+}
+
+/* Tokens the history may use, what is left of the context window once the
+ * reply has been accounted for */
+size_t openAiCtxHistoryBudget(openAiCtx *ctx) {
+    size_t reserve = OPEN_AI_TOKENS_PER_REPLY +
+                     (ctx->max_tokens ? ctx->max_tokens :
+                                        OPEN_AI_DEFAULT_REPLY_RESERVE);
+    return ctx->context_window > reserve ? ctx->context_window - reserve : 0;
+}
+
+/* Tokens of the history that is sent */
+size_t openAiCtxSentTokens(openAiCtx *ctx) {
+    return ctx->pinned_tokens + ctx->window_tokens;
+}
+
+/* Drop the oldest messages from the window until it and 'extra' tokens fit
+ * the budget. System messages are pinned rather than dropped */
+static void openAiCtxWindowEvict(openAiCtx *ctx, size_t extra) {
+    size_t budget = openAiCtxHistoryBudget(ctx);
+    openAiMessage *msg;
+    int tokens;
+
+    while (ctx->window != ctx->chat &&
+           ctx->pinned_tokens + ctx->window_tokens + extra > budget) {
+        msg = ctx->window->value;
+        tokens = openAiMessageTokens(ctx, msg);
+        if (msg->role == OPEN_AI_ROLE_SYSTEM) {
+            aoStrCatLen(ctx->pinned, ctx->messages->data + ctx->window_offset,
+                        msg->json_len);
+            ctx->pinned_tokens += tokens;
+        }
+        ctx->window_tokens -= tokens;
+        ctx->window_offset += msg->json_len;
+        ctx->window = ctx->window->next;
+    }
+}
+
+/* 'node' has just been appended to the history */
+static void openAiCtxWindowPush(openAiCtx *ctx, list *node) {
+    if (ctx->window == ctx->chat) {
+        ctx->window = node;
+    }
+    ctx->window_tokens += openAiMessageTokens(ctx, node->value);
+    openAiCtxWindowEvict(ctx, 0);
+}
+
+/* Start over when the history or the budget has changed other than by an
+ * append */
+static void openAiCtxWindowReset(openAiCtx *ctx) {
+    list *node = ctx->chat->next;
+
+    ctx->window = node;
+    ctx->window_offset = 0;
+    ctx->window_tokens = 0;
+    ctx->pinned_tokens = 0;
+    aoStrSetLen(ctx->pinned, 0);
+    while (node != ctx->chat) {
+        ctx->window_tokens += openAiMessageTokens(ctx, node->value);
+        node = node->next;
+    }
+    openAiCtxWindowEvict(ctx, 0);
+}
+
+/* Refuse a request that cannot fit, rather than paying for the round trip
+ * only for the server to reject it. 'msg' is the raw user message */
+static int openAiCtxPromptFits(openAiCtx *ctx, char *msg) {
+    size_t msg_tokens = OPEN_AI_TOKENS_PER_MESSAGE +
+                        bpeCountTokens(ctx->tokenizer, msg, strlen(msg));
+    size_t tokens = OPEN_AI_TOKENS_PER_REPLY + ctx->max_tokens + msg_tokens;
+
+    if (ctx->flags & OPEN_AI_FLAG_HISTORY) {
+        /* Make room for the message */
+        openAiCtxWindowEvict(ctx, msg_tokens);
+        tokens += openAiCtxSentTokens(ctx);
+    }
+    if (tokens > ctx->context_window) {
+        warning("Request needs ~%zu tokens, the context window is %zu. Try "
+                "/hist-del or /hist-clear\n",
+                tokens, ctx->context_window);
+        return 0;
+    }
+    return 1;
+}
+
 static void openAiAppendOptionsToPayload(openAiCtx *ctx, aoStr *payload,
                                          char *user_msg) {
     aoStrCatPrintf(payload, "{\"model\": \"%s\"", ctx->model);
@@ -216,23 +591,104 @@ static void openAiAppendOptionsToPayload(openAiCtx *ctx, aoStr *payload,
     if (ctx->top_p) {
         aoStrCatPrintf(payload, ",\"top_p\": %1.5f", ctx->top_p);
     }
+    aoStrCatLen(payload, ",\"messages\": [", 14);
     if (ctx->flags & OPEN_AI_FLAG_HISTORY) {
-        /* This can be optimised, by maintaining a string */
-        aoStrCatLen(payload, ",\"messages\": [", 14);
-        openAiMessage *msg;
-        list *node = ctx->chat->next;
-
-        while (node != ctx->chat) {
-            msg = node->value;
-            aoStrCatPrintf(payload, "{\"role\": \"%s\", \"content\": \"%s\"},",
-                           role_to_str[msg->role], aoStrGetData(msg->content));
-            node = node->next;
-        }
+        /* Already serialized, each message ends with a ',' */
+        aoStrCatLen(payload, ctx->pinned->data, ctx->pinned->len);
+        aoStrCatLen(payload, ctx->messages->data + ctx->window_offset,
+                    ctx->messages->len - ctx->window_offset);
     }
     aoStrCatPrintf(payload, "{\"role\": \"%s\", \"content\": \"%s\"}]",
                    role_to_str[OPEN_AI_ROLE_USER], user_msg);
 }
 
+static char *open_ai_message_columns[] = {"chat_id", "role", "msg"};
+
+/* The schema, migration i takes the database from version i to i + 1. A
+ * change to the schema is a new migration appended here, never an edit to
+ * one that has shipped */
+static char *open_ai_migrations[] = {
+        /* 1: Tables, which a database made before there were versions already
+         * has */
+        "CREATE TABLE IF NOT EXISTS chat(id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "name TEXT,"
+        "created DATETIME DEFAULT CURRENT_TIMESTAMP,"
+        "model TEXT);\n"
+        "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "chat_id INT,"
+        "created DATETIME DEFAULT CURRENT_TIMESTAMP,"
+        "role INT,"
+        "msg TEXT,"
+        "CONSTRAINT chat_k FOREIGN KEY(chat_id) REFERENCES chat(id) ON DELETE CASCADE);\n"
+        "CREATE TABLE IF NOT EXISTS cache(key BLOB PRIMARY KEY,"
+        "created INT,"
+        "size INT,"
+        "answer TEXT);\n",
+
+        /* 2: A chat's messages in the order they were written without a scan
+         * of every message */
+        "CREATE INDEX IF NOT EXISTS messages_chat_id ON messages(chat_id, id);\n",
+
+        /* 3: What has expired and how big the cache is without reading the
+         * answers */
+        "CREATE INDEX IF NOT EXISTS cache_created ON cache(created, size);\n",
+
+        /* 4: Messages left behind by chats deleted before their messages were
+         * deleted with them */
+        "DELETE FROM messages WHERE chat_id NOT IN (SELECT id FROM chat);\n",
+};
+
+/* Messages are stored json escaped, this is near enough to the text for the
+ * index and readable in a one line snippet */
+#define OPEN_AI_FTS_TEXT(col)                                              \
+    "replace(replace(replace(replace(" col ", '\\n', ' '), '\\t', ' '), " \
+    "'\\r', ' '), '\\\"', '\"')"
+
+/* Full text index of `messages`, kept in step by triggers so whichever
+ * connection writes a message indexes it. Searching is not essential so a
+ * sqlite without FTS5 only gets a warning */
+static void openAiCtxDbFtsInit(openAiCtx *ctx) {
+    sqlRow row;
+    int exists = 0;
+    char *err;
+
+    if (sqlSelect(ctx->db, &row,
+                  "SELECT 1 FROM sqlite_master WHERE name = 'messages_fts';",
+                  NULL, 0)) {
+        while (sqlIter(&row)) {
+            exists = 1;
+        }
+    }
+
+    char *sql =
+            "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5(msg);\n"
+            "CREATE TRIGGER IF NOT EXISTS messages_fts_insert AFTER INSERT ON messages BEGIN "
+            "INSERT INTO messages_fts(rowid, msg) VALUES (new.id, " OPEN_AI_FTS_TEXT("new.msg") "); "
+            "END;\n"
+            "CREATE TRIGGER IF NOT EXISTS messages_fts_delete AFTER DELETE ON messages BEGIN "
+            "DELETE FROM messages_fts WHERE rowid = old.id; "
+            "END;\n"
+            "CREATE TRIGGER IF NOT EXISTS messages_fts_update AFTER UPDATE OF msg ON messages BEGIN "
+            "UPDATE messages_fts SET msg = " OPEN_AI_FTS_TEXT("new.msg") " WHERE rowid = new.id; "
+            "END;\n";
+    if ((err = sqlExecRaw(ctx->db, sql)) != NULL) {
+        warning("Search is unavailable: %s\n", err);
+        sqlite3_free(err);
+        return;
+    }
+
+    /* Messages saved before there was an index */
+    if (!exists) {
+        err = sqlExecRaw(ctx->db,
+                         "INSERT INTO messages_fts(rowid, msg) "
+                         "SELECT id, " OPEN_AI_FTS_TEXT("msg") " FROM messages;");
+        if (err) {
+            warning("Failed to index saved messages: %s\n", err);
+            sqlite3_free(err);
+        }
+    }
+}
+
 void openAiCtxDbInit(openAiCtx *ctx) {
     if (ctx->db == NULL) {
         struct passwd *pw = getpwuid(getuid());
@@ -243,54 +699,143 @@ void openAiCtxDbInit(openAiCtx *ctx) {
         aoStr *db_name = aoStrAlloc(512);
         aoStrCatPrintf(db_name, "/%s/.%s", pw->pw_dir, SQL_DB_NAME);
 
-        ctx->db = sqlCtxNew(aoStrMove(db_name));
-
-        char *sql =
-                "CREATE TABLE IF NOT EXISTS chat(id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                "name TEXT,"
-                "created DATETIME DEFAULT CURRENT_TIMESTAMP,"
-                "model TEXT);\n"
-                "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                "chat_id INT,"
-                "created DATETIME DEFAULT CURRENT_TIMESTAMP,"
-                "role INT,"
-                "msg TEXT,"
-                "CONSTRAINT chat_k FOREIGN KEY(chat_id) REFERENCES chat(id) ON DELETE CASCADE);\n";
-        char *err = sqlExecRaw(ctx->db, sql);
-        if (err) {
-            panic("DB initialization error: %s\n", err);
+        ctx->db = sqlCtxNew(aoStrMove(db_name), ctx->durability);
+
+        if (!sqlMigrate(ctx->db, open_ai_migrations,
+                        sizeof(open_ai_migrations) /
+                                sizeof(open_ai_migrations[0]))) {
+            panic("DB initialization error\n");
+        }
+        openAiCtxDbFtsInit(ctx);
+
+        /* Saving still works without it, only slower */
+        ctx->writer = sqlWriterNew(ctx->db->dbname, ctx->durability,
+                                   SQL_WRITER_QUEUE_SIZE);
+    }
+}
+
+/* Warn about inserts the writer rolled back, any of the chat's messages in
+ * them are saved again by the next `openAiCtxDbSaveHistory` */
+void openAiCtxDbCheckWrites(openAiCtx *ctx) {
+    list *failures, *node, *msg_node;
+    sqlWriterFailure *failure;
+    openAiMessage *msg;
+
+    if (ctx->writer == NULL) {
+        return;
+    }
+    failures = sqlWriterFailures(ctx->writer);
+    if (failures == NULL) {
+        return;
+    }
+
+    for (node = failures->next; node != failures; node = node->next) {
+        failure = (sqlWriterFailure *)node->value;
+        warning("Failed to save history: %s\n", failure->error);
+        for (msg_node = ctx->chat->next; msg_node != ctx->chat;
+             msg_node = msg_node->next) {
+            msg = (openAiMessage *)msg_node->value;
+            if (msg->saving >= failure->first &&
+                msg->saving <= failure->last) {
+                msg->persisted = 0;
+                msg->saving = 0;
+            }
         }
     }
+    listRelease(failures, sqlWriterFailureRelease);
+}
+
+/* Wait for the messages queued by `openAiCtxDbSaveHistory` to be written,
+ * anything reading or deleting messages has to call this first */
+void openAiCtxDbFlush(openAiCtx *ctx) {
+    if (ctx->writer) {
+        sqlWriterDrain(ctx->writer);
+        openAiCtxDbCheckWrites(ctx);
+    }
+}
+
+/* Write anything still queued and stop the writer, saving after this happens
+ * on the calling thread */
+void openAiCtxDbClose(openAiCtx *ctx) {
+    openAiCtxDbFlush(ctx);
+    sqlWriterRelease(ctx->writer);
+    ctx->writer = NULL;
 }
 
+/* Insert 'rows' messages on the writer if there is one. Returns the writer's
+ * job for them, 1 if they were written here or 0 on failure */
+static long openAiCtxDbInsertMessages(openAiCtx *ctx, sqlParam *params,
+                                      int rows) {
+    int ok;
+    if (ctx->writer) {
+        return sqlWriterInsert(ctx->writer, "messages",
+                               open_ai_message_columns, 3, params, rows);
+    }
+    ok = sqlBegin(ctx->db) &&
+         sqlInsertBatch(ctx->db, "messages", open_ai_message_columns, 3,
+                        params, rows) &&
+         sqlCommit(ctx->db);
+    if (!ok) {
+        warning("Failed to save history: %s\n",
+                sqlite3_errmsg(ctx->db->conn));
+        sqlRollback(ctx->db);
+    }
+    return ok;
+}
+
+/* Write the messages that are not yet in the database in one transaction,
+ * queued to the writer if there is one */
 void openAiCtxDbSaveHistory(openAiCtx *ctx) {
-    /* I do know how to concatinate a string */
-    if (ctx->chat_len > 0) {
-        list *node = ctx->chat->next;
-        openAiMessage *msg;
+    list *node = ctx->chat->next;
+    openAiMessage *msg;
+    sqlParam *params;
+    long saving;
+    int rows = 0;
+
+    openAiCtxDbCheckWrites(ctx);
+    while (node != ctx->chat) {
+        rows += !((openAiMessage *)node->value)->persisted;
+        node = node->next;
+    }
+    if (rows == 0) {
+        return;
+    }
 
-        while (node != ctx->chat) {
+    params = malloc(sizeof(sqlParam) * 3 * rows);
+    rows = 0;
+    for (node = ctx->chat->next; node != ctx->chat; node = node->next) {
+        msg = (openAiMessage *)node->value;
+        if (msg->persisted) {
+            continue;
+        }
+        params[rows * 3].type = SQL_INT;
+        params[rows * 3].integer = ctx->chat_id;
+        params[rows * 3 + 1].type = SQL_INT;
+        params[rows * 3 + 1].integer = msg->role;
+        params[rows * 3 + 2].type = SQL_TEXT;
+        params[rows * 3 + 2].str = aoStrGetData(msg->content);
+        rows++;
+    }
+
+    saving = openAiCtxDbInsertMessages(ctx, params, rows);
+    if (saving) {
+        for (node = ctx->chat->next; node != ctx->chat; node = node->next) {
             msg = (openAiMessage *)node->value;
-            openAiCtxDbInsertMessage(ctx, msg->role, msg->content);
-            node = node->next;
+            if (!msg->persisted) {
+                msg->persisted = 1;
+                msg->saving = ctx->writer ? saving : 0;
+            }
         }
     }
+    free(params);
 }
 
 void openAiCtxDbNewChat(openAiCtx *ctx) {
-    sqlRow row;
     sqlParam params[1] = {
             {.type = SQL_TEXT, .str = ctx->model},
     };
-    sqlQuery(ctx->db, "INSERT INTO chat(model) VALUES(?);", params, 1);
-    sqlSelect(ctx->db, &row, "SELECT id FROM chat ORDER BY created LIMIT 1;",
-              NULL, 0);
-    int id = -1;
-    while (sqlIter(&row)) {
-        id = row.col[0].integer;
-    }
-    if (id) {
-        ctx->chat_id = id;
+    if (sqlQuery(ctx->db, "INSERT INTO chat(model) VALUES(?);", params, 1)) {
+        ctx->chat_id = sqlLastInsertId(ctx->db);
     }
 }
 
@@ -302,17 +847,32 @@ void openAiCtxDbRenameChat(openAiCtx *ctx, int id, char *name) {
     sqlQuery(ctx->db, "UPDATE chat SET name = ? WHERE id = ?;", params, 2);
 }
 
+/* Foreign keys are not turned on so the messages are deleted here, which also
+ * takes them out of `messages_fts` */
 void openAiCtxDbDeleteChatById(openAiCtx *ctx, int id) {
     sqlParam params[1] = {
             {.type = SQL_INT, .integer = id},
     };
-    sqlQuery(ctx->db, "DELETE FROM chat WHERE id = ?", params, 1);
+    int ok;
+
+    openAiCtxDbFlush(ctx);
+    ok = sqlBegin(ctx->db) &&
+         sqlQuery(ctx->db, "DELETE FROM messages WHERE chat_id = ?;", params,
+                  1) &&
+         sqlQuery(ctx->db, "DELETE FROM chat WHERE id = ?;", params, 1) &&
+         sqlCommit(ctx->db);
+    if (!ok) {
+        warning("Failed to delete chat %d: %s\n", id,
+                sqlite3_errmsg(ctx->db->conn));
+        sqlRollback(ctx->db);
+    }
 }
 
 void openAiCtxDbDeleteMessageById(openAiCtx *ctx, int id) {
     sqlParam params[1] = {
             {.type = SQL_INT, .integer = id},
     };
+    openAiCtxDbFlush(ctx);
     sqlQuery(ctx->db, "DELETE FROM messags WHERE id = ?", params, 1);
 }
 
@@ -322,9 +882,7 @@ void openAiCtxDbInsertMessage(openAiCtx *ctx, int role, aoStr *msg) {
             {.type = SQL_INT, .integer = role},
             {.type = SQL_TEXT, .str = aoStrGetData(msg)},
     };
-    sqlQuery(ctx->db,
-             "INSERT INTO messages (chat_id, role, msg) VALUES (?, ?, ?);",
-             params, 3);
+    openAiCtxDbInsertMessages(ctx, params, 1);
 }
 
 list *openAiDbGetMessagesByChatId(openAiCtx *ctx, int chat_id, int *count) {
@@ -336,19 +894,25 @@ list *openAiDbGetMessagesByChatId(openAiCtx *ctx, int chat_id, int *count) {
             {.type = SQL_INT, .integer = chat_id},
     };
 
+    openAiCtxDbFlush(ctx);
     if (!sqlSelect(
                 ctx->db, &row,
-                "SELECT messages.role, messages.msg FROM messages WHERE messages.chat_id = ?;",
+                "SELECT messages.role, messages.msg FROM messages WHERE messages.chat_id = ? ORDER BY messages.id;",
                 params, 1)) {
         return NULL;
     }
 
     while (sqlIter(&row)) {
         msg = (openAiMessage *)malloc(sizeof(openAiMessage));
+        msg->name = NULL;
+        msg->tokens = -1;
+        msg->persisted = 1;
+        msg->saving = 0;
         msg->role = row.col[0].integer;
         msg->content = aoStrDupRaw(row.col[1].str, row.col[1].len,
                                    row.col[1].len);
         listAppend(chat, msg);
+        i++;
     }
     *count = i;
 
@@ -367,6 +931,54 @@ void openAiCtxLoadChatHistoryById(openAiCtx *ctx, int chat_id) {
     ctx->chat = msgs;
     ctx->chat_id = chat_id;
     ctx->chat_len = count;
+    openAiCtxMessagesRebuild(ctx);
+}
+
+/* Saved messages matching the words in 'query', best first, as lines of
+ * the chat, role and a snippet with the matches in bold. NULL if searching
+ * failed */
+list *openAiCtxDbSearch(openAiCtx *ctx, char *query, int limit) {
+    sqlRow row;
+    sqlFtsMatch *match;
+    list *matches, *node, *lines;
+    aoStr *line;
+    sqlParam params[1];
+
+    openAiCtxDbFlush(ctx);
+    /* Joined so messages left behind by a deleted chat do not take up any
+     * of the 'limit' */
+    matches = sqlFtsSearch(ctx->db, "messages_fts",
+                           "JOIN messages ON messages.id = messages_fts.rowid "
+                           "JOIN chat ON chat.id = messages.chat_id",
+                           query, "\033[1m", "\033[0m", limit);
+    if (matches == NULL) {
+        return NULL;
+    }
+
+    lines = listNew();
+    for (node = matches->next; node != matches; node = node->next) {
+        match = (sqlFtsMatch *)node->value;
+        params[0].type = SQL_INT;
+        params[0].integer = match->rowid;
+        if (!sqlSelect(ctx->db, &row,
+                       "SELECT chat.id, chat.name, messages.role FROM messages "
+                       "JOIN chat ON chat.id = messages.chat_id "
+                       "WHERE messages.id = ?;",
+                       params, 1)) {
+            continue;
+        }
+        while (sqlIter(&row)) {
+            line = aoStrAlloc(256);
+            aoStrCatPrintf(line, "[%ld] %s (%s): %s", row.col[0].integer,
+                           row.col[1].type == SQL_TEXT ? row.col[1].str
+                                                       : "(null)",
+                           role_to_str[row.col[2].integer],
+                           match->snippet->data);
+            listAppend(lines, line);
+        }
+    }
+    listRelease(matches, sqlFtsMatchRelease);
+    return lines;
 }
 
 list *openAiCtxGetChats(openAiCtx *ctx) {
@@ -393,14 +1005,19 @@ list *openAiCtxGetChats(openAiCtx *ctx) {
 int *openAiCtxDbGetChatIds(openAiCtx *ctx, int *count) {
     int *arr = NULL;
     sqlRow row;
-    int i = 0;
+    int i = 0, capacity = 16;
     *count = 0;
 
-    sqlSelect(ctx->db, &row, "SELECT id from chat;", NULL, 0);
-
-    arr = (int *)malloc(sizeof(int) * row.cols);
+    arr = (int *)malloc(sizeof(int) * capacity);
+    if (!sqlSelect(ctx->db, &row, "SELECT id from chat;", NULL, 0)) {
+        return arr;
+    }
 
     while (sqlIter(&row)) {
+        if (i == capacity) {
+            capacity *= 2;
+            arr = (int *)realloc(arr, sizeof(int) * capacity);
+        }
         arr[i++] = row.col[0].integer;
     }
     *count = i;
@@ -409,21 +1026,235 @@ int *openAiCtxDbGetChatIds(openAiCtx *ctx, int *count) {
 
 void openAiCtxHistoryDel(openAiCtx *ctx, int msg_id) {
     int i = 0;
+    size_t offset = 0, len;
+    openAiMessage *msg;
     list *node = ctx->chat->next;
     while (node != ctx->chat) {
-        if (i == msg_id && node->value) {
+        msg = node->value;
+        if (i == msg_id && msg) {
+            /* Splice the message out of the serialized history */
+            len = msg->json_len;
+            memmove(ctx->messages->data + offset,
+                    ctx->messages->data + offset + len,
+                    ctx->messages->len - offset - len);
+            aoStrSetLen(ctx->messages, ctx->messages->len - len);
+
             node->prev->next = node->next;
             node->next->prev = node->prev;
             openAiMessageRelease(node->value);
             free(node);
             ctx->chat_len--;
+            openAiCtxWindowReset(ctx);
             return;
         }
+        offset += msg->json_len;
         i++;
         node = node->next;
     }
 }
 
+/*=============================================================================
+ * Answers cached by the hash of the payload that asked for them
+ *============================================================================*/
+
+static int openAiCacheEnabled(openAiCtx *ctx) {
+    return ctx->db != NULL && ctx->cache_ttl > 0;
+}
+
+/* The answer to the payload with 'key' if it has not expired */
+static aoStr *openAiCacheGet(openAiCtx *ctx, unsigned char *key) {
+    aoStr *answer = NULL;
+    sqlRow row;
+    sqlParam params[2] = {
+            {.type = SQL_BLOB, .blob = key, .blob_len = HASH_128_LEN},
+            {.type = SQL_INT, .integer = time(NULL) - ctx->cache_ttl},
+    };
+
+    if (!sqlSelect(ctx->db, &row,
+                   "SELECT answer FROM cache WHERE key = ? AND created > ?;",
+                   params, 2)) {
+        return NULL;
+    }
+
+    while (sqlIter(&row)) {
+        if (answer == NULL && row.col[0].type == SQL_TEXT) {
+            answer = aoStrDupRaw(row.col[0].str, row.col[0].len,
+                                 row.col[0].len);
+        }
+    }
+    return answer;
+}
+
+/* Cache the raw 'answer', then drop what has expired and the oldest answers
+ * until the rest fit in `cache_max` */
+static void openAiCachePut(openAiCtx *ctx, unsigned char *key, aoStr *answer) {
+    time_t now = time(NULL);
+    sqlParam insert[4] = {
+            {.type = SQL_BLOB, .blob = key, .blob_len = HASH_128_LEN},
+            {.type = SQL_INT, .integer = now},
+            {.type = SQL_INT, .integer = answer->len},
+            {.type = SQL_TEXT, .str = answer->data},
+    };
+    sqlParam expired[1] = {
+            {.type = SQL_INT, .integer = now - ctx->cache_ttl},
+    };
+    sqlParam max[1] = {
+            {.type = SQL_INT, .integer = ctx->cache_max},
+    };
+    long total = 0;
+    sqlRow row;
+
+    /* One commit rather than three, this runs after every answer */
+    if (!sqlBegin(ctx->db)) {
+        return;
+    }
+    if (!sqlQuery(ctx->db,
+                  "INSERT OR REPLACE INTO cache (key, created, size, answer) "
+                  "VALUES (?, ?, ?, ?);",
+                  insert, 4) ||
+        !sqlQuery(ctx->db, "DELETE FROM cache WHERE created <= ?;", expired,
+                  1)) {
+        sqlRollback(ctx->db);
+        return;
+    }
+
+    /* Summed from `cache_created`, the running totals that pick what to
+     * drop sort the whole cache so are only worked out once it is too big */
+    if (sqlSelect(ctx->db, &row, "SELECT SUM(size) FROM cache;", NULL, 0)) {
+        while (sqlIter(&row)) {
+            if (row.col[0].type == SQL_INT) {
+                total = row.col[0].integer;
+            }
+        }
+    }
+    if ((total > (long)ctx->cache_max &&
+         !sqlQuery(ctx->db,
+                   "DELETE FROM cache WHERE rowid IN ("
+                   "SELECT rowid FROM (SELECT rowid, SUM(size) OVER "
+                   "(ORDER BY created DESC, rowid DESC) AS total FROM cache) "
+                   "WHERE total > ?);",
+                   max, 1)) ||
+        !sqlCommit(ctx->db)) {
+        sqlRollback(ctx->db);
+    }
+}
+
+/*=============================================================================
+ * Requests, everything goes through `ctx->loop`
+ *============================================================================*/
+
+/* State carried by a request while it is in flight */
+typedef struct openAiRequest {
+    openAiCtx *ctx;
+    aoStr *user_msg; /* Escaped user message of a chat */
+    aoStr *answer;   /* Assistant reply accumulated from a stream */
+    jsonSax *sax;    /* Reused for parsing each event of a stream */
+    openAiCallback *callback;
+    void *privdata;
+    int cacheable; /* The answer is cached under `cache_key` */
+    unsigned char cache_key[HASH_128_LEN];
+} openAiRequest;
+
+static openAiRequest *openAiRequestNew(openAiCtx *ctx,
+                                       openAiCallback *callback,
+                                       void *privdata) {
+    openAiRequest *oreq = malloc(sizeof(openAiRequest));
+    oreq->ctx = ctx;
+    oreq->user_msg = NULL;
+    oreq->answer = aoStrAlloc(512);
+    aoStrSetLen(oreq->answer, 0);
+    oreq->sax = NULL;
+    oreq->callback = callback;
+    oreq->privdata = privdata;
+    oreq->cacheable = 0;
+    return oreq;
+}
+
+static void openAiRequestRelease(openAiRequest *oreq) {
+    if (oreq) {
+        aoStrRelease(oreq->user_msg);
+        aoStrRelease(oreq->answer);
+        jsonSaxRelease(oreq->sax);
+        free(oreq);
+    }
+}
+
+static httpRequest *openAiSubmit(openAiCtx *ctx, char *url, int method,
+                                 aoStr *payload, openAiRequest *oreq,
+                                 sseEventCallback *on_event,
+                                 httpCompleteCallback *on_complete) {
+    httpRequest *req = httpRequestNew(url, method, ctx->auth_headers, payload,
+                                      ctx->flags);
+    if (req == NULL) {
+        openAiRequestRelease(oreq);
+        return NULL;
+    }
+
+    if (on_event) {
+        httpRequestSetStream(req, on_event, on_complete, oreq);
+    } else {
+        httpRequestSetJSON(req, on_complete, oreq);
+    }
+    if (httpLoopSubmit(ctx->loop, req) != HTTP_OK) {
+        openAiRequestRelease(oreq);
+        httpRequestRelease(req);
+        return NULL;
+    }
+    return req;
+}
+
+/* The body was parsed as it arrived, take the tree off the response */
+static json *openAiParseResponse(httpRequest *req) {
+    openAiRequest *oreq = (openAiRequest *)req->privdata;
+    httpResponse *res = req->response;
+    json *j = NULL, *sel;
+    aoStr *answer;
+
+    if (httpRequestOk(req) && res->content_type == RES_TYPE_JSON) {
+        j = res->parsed;
+        res->parsed = NULL;
+    }
+
+    if (j && oreq->cacheable &&
+        (sel = jsonSelect(j, ".choices[0].message.content:s")) != NULL) {
+        answer = aoStrFromString(sel->str, strlen(sel->str));
+        openAiCachePut(oreq->ctx, oreq->cache_key, answer);
+        free(answer);
+    }
+    return j;
+}
+
+/* Hands the parsed body to the callback. When there is no callback someone is
+ * blocked in `openAiWaitJSON` and will collect the response */
+static void openAiJSONComplete(httpRequest *req) {
+    openAiRequest *oreq = (openAiRequest *)req->privdata;
+    json *resp;
+
+    if (oreq->callback == NULL) {
+        return;
+    }
+
+    resp = openAiParseResponse(req);
+    oreq->callback(oreq->ctx, resp, oreq->privdata);
+    jsonRelease(resp);
+    openAiRequestRelease(oreq);
+    httpRequestRelease(req);
+}
+
+static json *openAiWaitJSON(openAiCtx *ctx, httpRequest *req) {
+    json *resp;
+
+    if (req == NULL) {
+        return NULL;
+    }
+
+    httpLoopWait(ctx->loop, req);
+    resp = openAiParseResponse(req);
+    openAiRequestRelease(req->privdata);
+    httpRequestRelease(req);
+    return resp;
+}
+
 /*
     {
       "id": "text-search-babbage-doc-001",
@@ -450,121 +1281,267 @@ void openAiCtxHistoryDel(openAiCtx *ctx, int msg_id) {
       "parent": null
     },
 */
+httpRequest *openAiListModelsAsync(openAiCtx *ctx, openAiCallback *callback,
+                                   void *privdata) {
+    return openAiSubmit(ctx, OPEN_AI_MODELS_URL, HTTP_REQ_GET, NULL,
+                        openAiRequestNew(ctx, callback, privdata), NULL,
+                        openAiJSONComplete);
+}
+
 json *openAiListModels(openAiCtx *ctx) {
-    return curlHttpGetJSON("https://api.openai.com/v1/models",
-                           ctx->auth_headers, ctx->flags);
+    return openAiWaitJSON(ctx, openAiListModelsAsync(ctx, NULL, NULL));
 }
 
-static size_t openAiChatStreamCallback(char *stream, size_t size, size_t nmemb,
-                                       void **userdata) {
-    openAiCtx **ctx = (openAiCtx **)userdata;
-    json *j, *sel, *choices = NULL;
-    char *ptr = stream;
-    size_t rbytes = size * nmemb;
+/* Everything written of a streamed answer goes through here, whether it came
+ * off the network or out of the cache */
+static void openAiChatStreamWrite(openAiRequest *oreq, const char *str,
+                                  size_t len) {
+    renderWrite(oreq->ctx->render, str, len);
+    aoStrCatLen(oreq->answer, str, len);
+}
 
-    if ((*ctx)->flags & OPEN_AI_FLAG_VERBOSE) {
-        printf("%s\n", stream);
+/* `httpLoopRun` that wakes up in time to write out streamed text, which would
+ * otherwise sit in the renderer until the next chunk arrives */
+static void openAiLoopRun(openAiCtx *ctx) {
+    while (httpLoopRunOnce(ctx->loop,
+                           renderTimeout(ctx->render, HTTP_LOOP_POLL_MS))) {
+        renderTick(ctx->render);
     }
+    renderFlush(ctx->render);
+}
 
-    if (*stream == '{') {
-        j = jsonParseWithLen(stream, rbytes);
-        if ((sel = jsonSelect(j, ".error.message")) != NULL) {
-            prompt_warning("%s\n", sel->str);
-            aoStrCat((*ctx)->tmp_buffer, sel->str);
-            return rbytes;
-        }
+/* Called for every value in an event, stops at the content as that is all we
+ * are after */
+static int openAiChatStreamValue(jsonSax *sax, void *privdata) {
+    openAiRequest *oreq = (openAiRequest *)privdata;
+
+    if (!jsonSelectorMatchSax(oreq->ctx->stream_content, sax)) {
+        return 1;
     }
 
-    while (*ptr) {
-        if (!strncmp(ptr, "data: ", 6)) {
-            ptr += 5;
-            while (*ptr != '{') {
-                ptr++;
-            }
-            j = jsonParseWithLen(ptr, rbytes - (stream - ptr));
-            if (!j) {
-                warning("Failed to Parse JSON\n");
-            } else if (!jsonOk(j)) {
-                warning("Failed to Parse JSON");
-                jsonPrint(j);
-                jsonPrintError(j);
-            }
+    openAiChatStreamWrite(oreq, sax->str, sax->len);
+    return 0;
+}
 
-            choices = jsonSelect(j, ".choices[0]:o");
-            sel = jsonSelect(choices, ".delta.content:s");
+/* Called with the payload of each server-sent event:
+ * {"choices":[{"delta":{"content":"Hello"},"finish_reason":null}]} */
+static int openAiChatStreamEvent(sseEvent *ev, void *privdata) {
+    openAiRequest *oreq = (openAiRequest *)privdata;
 
-            if (sel) {
-                printf("%s", sel->str);
-                fflush(stdout);
-                aoStrCat((*ctx)->tmp_buffer, sel->str);
-                jsonRelease(j);
-            } else {
-                sel = jsonSelect(choices, ".finish_reason");
-                if (sel) {
-                    jsonRelease(j);
-                    break;
-                }
-                sel = jsonSelect(j, ".finish_reason");
-                if (sel) {
-                    jsonRelease(j);
-                    break;
-                }
+    if (oreq->ctx->flags & OPEN_AI_FLAG_VERBOSE) {
+        renderFlush(oreq->ctx->render);
+        printf("%.*s\n", (int)ev->len, ev->data);
+    }
 
-                jsonPrint(j);
-                jsonRelease(j);
-            }
+    if (ev->type == SSE_EVENT_DONE) {
+        return 1;
+    }
+
+    /* No tree is built, the content is handed to us as it is found */
+    if (jsonSaxParse(oreq->sax, ev->data, ev->len) != JSON_OK) {
+        warning("Failed to Parse JSON\n");
+        jsonSaxPrintError(oreq->sax);
+    }
+    return 1;
+}
+
+/* A failed stream comes back as a plain json body:
+ * {"error": {"message": "..."}} */
+static void openAiPrintStreamError(httpRequest *req) {
+    httpResponse *res = req->response;
+    json *j, *sel;
+
+    if (res->content_type != RES_TYPE_JSON || res->body->len == 0) {
+        warning("Failed to make request\n");
+        return;
+    }
+
+    j = jsonParseWithLen(res->body->data, res->body->len);
+    if ((sel = jsonSelect(j, ".error.message:s")) != NULL) {
+        prompt_warning("%s\n", sel->str);
+    } else {
+        warning("Failed to make request\n");
+    }
+    jsonRelease(j);
+}
+
+/* The answer is complete, keep it and the question that asked for it */
+static void openAiChatStreamFinish(openAiRequest *oreq) {
+    openAiCtx *ctx = oreq->ctx;
+    aoStr *user_escaped_msg = oreq->user_msg;
+    aoStr *assistant_escaped_msg = NULL;
+
+    renderEnd(ctx->render);
+    printf("\n\n");
+    assistant_escaped_msg = aoStrEscapeString(oreq->answer);
+
+    /* Store in history, which then owns both messages, and in the db */
+    if (ctx->flags & OPEN_AI_FLAG_HISTORY) {
+        openAiChatHistoryAppend(ctx, OPEN_AI_ROLE_USER, NULL, user_escaped_msg);
+        openAiChatHistoryAppend(ctx, OPEN_AI_ROLE_ASSISTANT, NULL,
+                                assistant_escaped_msg);
+        oreq->user_msg = NULL;
+        if (ctx->flags & OPEN_AI_FLAG_PERSIST) {
+            openAiCtxDbSaveHistory(ctx);
         }
-        ptr++;
+    } else {
+        if (ctx->flags & OPEN_AI_FLAG_PERSIST) {
+            sqlParam params[6] = {
+                    {.type = SQL_INT, .integer = ctx->chat_id},
+                    {.type = SQL_INT, .integer = OPEN_AI_ROLE_USER},
+                    {.type = SQL_TEXT, .str = user_escaped_msg->data},
+                    {.type = SQL_INT, .integer = ctx->chat_id},
+                    {.type = SQL_INT, .integer = OPEN_AI_ROLE_ASSISTANT},
+                    {.type = SQL_TEXT, .str = assistant_escaped_msg->data},
+            };
+            openAiCtxDbInsertMessages(ctx, params, 2);
+        }
+        aoStrRelease(assistant_escaped_msg);
+    }
+}
+
+static void openAiChatStreamComplete(httpRequest *req) {
+    openAiRequest *oreq = (openAiRequest *)req->privdata;
+
+    if (oreq->ctx->stream == req) {
+        oreq->ctx->stream = NULL;
     }
 
-    /* this should be collecting ONLY the message from the json above */
-    return rbytes;
+    /* What had arrived is kept as the answer, but not cached as it is not
+     * the whole of it */
+    if (req->cancelled) {
+        renderEnd(oreq->ctx->render);
+        printf("\033[0;33m [cancelled]\033[0m");
+        if (oreq->answer->len) {
+            openAiChatStreamFinish(oreq);
+        } else {
+            printf("\n\n");
+        }
+        openAiRequestRelease(oreq);
+        httpRequestRelease(req);
+        return;
+    }
+
+    if (!httpRequestOk(req)) {
+        renderEnd(oreq->ctx->render);
+        openAiPrintStreamError(req);
+        openAiRequestRelease(oreq);
+        httpRequestRelease(req);
+        return;
+    }
+
+    if (oreq->cacheable) {
+        openAiCachePut(oreq->ctx, oreq->cache_key, oreq->answer);
+    }
+    openAiChatStreamFinish(oreq);
+    openAiRequestRelease(oreq);
+    httpRequestRelease(req);
 }
 
-void openAiChatStream(openAiCtx *ctx, char *msg) {
-    aoStr *payload = aoStrAlloc(512);
+/* Build the payload for a chat completion and the request that will carry
+ * it, NULL if it cannot fit in the context window. The payload is left open
+ * for the caller to add to and close, the cache key is of everything up to
+ * that point so a question hits whether it is streamed or not */
+static openAiRequest *openAiChatRequestNew(openAiCtx *ctx, char *msg,
+                                           aoStr *payload,
+                                           openAiCallback *callback,
+                                           void *privdata) {
     size_t msg_len = strlen(msg);
     /* msg gets freed by the caller */
     aoStr *ref = aoStrFromString(msg, msg_len);
-    aoStr *user_escaped_msg = NULL, *assistant_escaped_msg = NULL;
-    int http_ok = 0;
+    openAiRequest *oreq;
+
+    if (!openAiCtxPromptFits(ctx, msg)) {
+        free(ref);
+        return NULL;
+    }
 
-    user_escaped_msg = aoStrEscapeString(ref);
+    oreq = openAiRequestNew(ctx, callback, privdata);
+    oreq->user_msg = aoStrEscapeString(ref);
     free(ref);
 
-    openAiAppendOptionsToPayload(ctx, payload, user_escaped_msg->data);
+    openAiAppendOptionsToPayload(ctx, payload, oreq->user_msg->data);
+    if (openAiCacheEnabled(ctx)) {
+        hashMurmur3_128(payload->data, payload->len, 0, oreq->cache_key);
+        oreq->cacheable = 1;
+    }
+    return oreq;
+}
+
+static httpRequest *openAiChatStreamSubmit(openAiCtx *ctx,
+                                           openAiRequest *oreq,
+                                           aoStr *payload) {
+    httpRequest *req;
+
     aoStrCat(payload, ",\"stream\": true}");
 
     if (ctx->flags & OPEN_AI_FLAG_VERBOSE) {
         printf("%s\n", aoStrGetData(payload));
     }
 
-    printf("\033[0;32m[%s]:\033[0m ", ctx->model);
-    fflush(stdout);
-    http_ok = curlHttpStreamPost("https://api.openai.com/v1/chat/completions",
-                                 ctx->auth_headers, payload, (void **)&ctx,
-                                 openAiChatStreamCallback, ctx->flags);
-    if (!http_ok) {
-        warning("Failed to make request\n");
+    oreq->sax = jsonSaxNew(openAiChatStreamValue, oreq);
+    req = openAiSubmit(ctx, OPEN_AI_COMPLETIONS_URL, HTTP_REQ_POST, payload,
+                       oreq, openAiChatStreamEvent, openAiChatStreamComplete);
+    if (req) {
+        ctx->stream = req;
+    }
+    return req;
+}
+
+/* Stop the answer being streamed, the transfer is aborted the next time the
+ * loop runs and what has arrived of the answer is kept in the history along
+ * with the question. Safe to call from a `httpLoopWatch` callback */
+void openAiCtxCancel(openAiCtx *ctx) {
+    httpRequestCancel(ctx->stream);
+}
+
+/* The answer is only cached, it is not looked for in the cache */
+httpRequest *openAiChatStreamAsync(openAiCtx *ctx, char *msg) {
+    aoStr *payload = aoStrAlloc(512);
+    openAiRequest *oreq;
+    httpRequest *req = NULL;
+
+    aoStrSetLen(payload, 0);
+    oreq = openAiChatRequestNew(ctx, msg, payload, NULL, NULL);
+    if (oreq) {
+        req = openAiChatStreamSubmit(ctx, oreq, payload);
+    }
+    aoStrRelease(payload);
+    return req;
+}
+
+void openAiChatStream(openAiCtx *ctx, char *msg) {
+    aoStr *payload = aoStrAlloc(512);
+    openAiRequest *oreq;
+    aoStr *cached = NULL;
+
+    aoStrSetLen(payload, 0);
+    if ((oreq = openAiChatRequestNew(ctx, msg, payload, NULL, NULL)) == NULL) {
+        aoStrRelease(payload);
         return;
     }
-    printf("\n\n");
-    assistant_escaped_msg = aoStrEscapeString(ctx->tmp_buffer);
 
-    /* Store in history */
-    if (ctx->flags & OPEN_AI_FLAG_HISTORY) {
-        openAiChatHistoryAppend(ctx, OPEN_AI_ROLE_USER, NULL, user_escaped_msg);
-        openAiChatHistoryAppend(ctx, OPEN_AI_ROLE_ASSISTANT, NULL,
-                                assistant_escaped_msg);
+    if (oreq->cacheable) {
+        cached = openAiCacheGet(ctx, oreq->cache_key);
     }
 
-    /* Store in db */
-    if (ctx->flags & OPEN_AI_FLAG_PERSIST) {
-        openAiCtxDbInsertMessage(ctx, OPEN_AI_ROLE_USER, user_escaped_msg);
-        openAiCtxDbInsertMessage(ctx, OPEN_AI_ROLE_ASSISTANT,
-                                 assistant_escaped_msg);
+    printf("\033[0;32m[%s]:\033[0m ", ctx->model);
+    fflush(stdout);
+
+    if (cached) {
+        /* Replayed as though it had been streamed, but marked so it is not
+         * taken for a fresh answer */
+        openAiChatStreamWrite(oreq, cached->data, cached->len);
+        renderEnd(ctx->render);
+        printf("\033[0;33m [cached]\033[0m");
+        openAiChatStreamFinish(oreq);
+        openAiRequestRelease(oreq);
+        aoStrRelease(cached);
+    } else if (openAiChatStreamSubmit(ctx, oreq, payload) != NULL) {
+        /* The request releases itself on completion */
+        openAiLoopRun(ctx);
     }
-    aoStrSetLen(ctx->tmp_buffer, 0);
+    aoStrRelease(payload);
 }
 
 /**
@@ -587,12 +1564,70 @@ void openAiChatStream(openAiCtx *ctx, char *msg) {
   }
 }
  */
+httpRequest *openAiChatAsync(openAiCtx *ctx, char *msg,
+                             openAiCallback *callback, void *privdata) {
+    aoStr *payload = aoStrAlloc(512);
+    openAiRequest *oreq;
+    httpRequest *req = NULL;
+
+    aoStrSetLen(payload, 0);
+    oreq = openAiChatRequestNew(ctx, msg, payload, callback, privdata);
+    if (oreq) {
+        aoStrPutChar(payload, '}');
+        req = openAiSubmit(ctx, OPEN_AI_COMPLETIONS_URL, HTTP_REQ_POST,
+                           payload, oreq, NULL, openAiJSONComplete);
+    }
+    aoStrRelease(payload);
+    return req;
+}
+
+/* Looks in the cache before going to the network, a cached answer comes back
+ * in the shape of a response */
 json *openAiChat(openAiCtx *ctx, char *msg) {
     aoStr *payload = aoStrAlloc(512);
-    openAiAppendOptionsToPayload(ctx, payload, msg);
+    aoStr *cached = NULL, *escaped, *body;
+    openAiRequest *oreq;
+    httpRequest *req;
+    json *resp;
+
+    aoStrSetLen(payload, 0);
+    if ((oreq = openAiChatRequestNew(ctx, msg, payload, NULL, NULL)) == NULL) {
+        aoStrRelease(payload);
+        return NULL;
+    }
+
+    if (oreq->cacheable) {
+        cached = openAiCacheGet(ctx, oreq->cache_key);
+    }
+
+    if (cached) {
+        escaped = aoStrEscapeString(cached);
+        body = aoStrAlloc(escaped->len + 128);
+        aoStrSetLen(body, 0);
+        aoStrCatPrintf(body,
+                       "{\"object\": \"chat.completion\", \"cached\": true, "
+                       "\"model\": \"%s\", \"choices\": [{\"index\": 0, "
+                       "\"message\": {\"role\": \"assistant\", \"content\": \"",
+                       ctx->model);
+        aoStrCatLen(body, escaped->data, escaped->len);
+        aoStrCat(body, "\"}, \"finish_reason\": \"stop\"}]}");
+        resp = jsonParseWithLen(body->data, body->len);
+        aoStrRelease(escaped);
+        aoStrRelease(body);
+        aoStrRelease(cached);
+        aoStrRelease(payload);
+        openAiRequestRelease(oreq);
+        return resp;
+    }
+
     aoStrPutChar(payload, '}');
-    json *resp = curlHttpPostJSON("https://api.openai.com/v1/chat/completions",
-                                  ctx->auth_headers, payload, ctx->flags);
+    req = openAiSubmit(ctx, OPEN_AI_COMPLETIONS_URL, HTTP_REQ_POST, payload,
+                       oreq, NULL, openAiJSONComplete);
     aoStrRelease(payload);
-    return resp;
+    return openAiWaitJSON(ctx, req);
+}
+
+/* Drive every request submitted through the ctx to completion */
+void openAiRun(openAiCtx *ctx) {
+    openAiLoopRun(ctx);
 }
@@ -10,10 +10,20 @@
 #include <stddef.h>
 
 #include "aostr.h"
+#include "bpe.h"
+#include "http.h"
+#include "json-selector.h"
 #include "json.h"
 #include "list.h"
+#include "render.h"
 #include "sql.h"
 
+#ifndef OPEN_AI_API_URL
+#define OPEN_AI_API_URL "https://api.openai.com/v1"
+#endif
+#define OPEN_AI_COMPLETIONS_URL OPEN_AI_API_URL "/chat/completions"
+#define OPEN_AI_MODELS_URL      OPEN_AI_API_URL "/models"
+
 #define OPEN_AI_FLAG_VERBOSE (1)
 #define OPEN_AI_FLAG_HISTORY (2)
 #define OPEN_AI_FLAG_PERSIST (4)
@@ -24,11 +34,32 @@
 #define OPEN_AI_ROLE_SYSTEM    (2)
 #define OPEN_AI_ROLE_FUNCTION  (4)
 
+/* Tokens the model can attend to when nothing else is known about it */
+#define OPEN_AI_DEFAULT_CONTEXT_WINDOW (4096)
+/* Left for the reply when the history is budgeted and max_tokens is not set
+ */
+#define OPEN_AI_DEFAULT_REPLY_RESERVE (512)
+
+/* Answers are not cached unless asked for, then in no more than 16mb */
+#define OPEN_AI_CACHE_MAX (16 * 1024 * 1024)
+/* Most matches printed by a search of the saved messages */
+#define OPEN_AI_SEARCH_LIMIT (20)
+/* Every message is wrapped in a few tokens marking its role, and the reply is
+ * primed with a few more */
+#define OPEN_AI_TOKENS_PER_MESSAGE (3)
+#define OPEN_AI_TOKENS_PER_REPLY   (3)
+
 typedef struct openAiMessage {
-    int role;       /* Required - The role one of system, user, assistant or
-                         function */
-    aoStr *content; /* Required - contents of the message */
-    char *name;     /* Optional - Author of the message */
+    int role;        /* Required - The role one of system, user, assistant or
+                          function */
+    aoStr *content;  /* Required - contents of the message */
+    char *name;      /* Optional - Author of the message */
+    size_t json_len; /* Length of the message in `openAiCtx.messages` */
+    int tokens;      /* Cached cost of the message in the prompt, -1 if it
+                        has not been counted */
+    int persisted;   /* Has been written to the database, or queued to be */
+    long saving;     /* The writer job it was queued on, the flag is cleared
+                        if that is rolled back */
 } openAiMessage;
 
 typedef struct openAiCtx {
@@ -62,12 +93,40 @@ typedef struct openAiCtx {
     int flags;   /* Whether to use the stream api, history etc.. */
 
     sqlCtx *db; /* Only exists if OPEN_AI_FLAG_PERSIST has been set */
+    SqlDurability durability; /* Of `db`, only takes effect when opened */
+    sqlWriter *writer; /* Messages are saved through this, so the prompt does
+                          not wait on the disk. NULL if it could not start */
 
     list *chat;
     int chat_len;
-    aoStr *tmp_buffer;
+    aoStr *messages; /* `chat` serialized for the "messages" array of a
+                        request, kept in step with it */
+    httpLoop *loop; /* All requests made through the ctx run on this */
+    renderer *render; /* Streamed answers are written through this */
+    httpRequest *stream; /* The answer being streamed, NULL if there is none */
+    jsonSelector *stream_content; /* Selects the text of a streamed event */
+    bpe *tokenizer;        /* NULL if there are no tables, then tokens are
+                              estimated */
+    size_t context_window; /* Most tokens a request and its reply can use */
+
+    /* The history sent is `pinned` followed by `messages` from `window`
+     * onwards, the oldest messages are dropped from the window once it no
+     * longer fits in the budget */
+    list *window;         /* First message sent, `chat` if none are */
+    size_t window_offset; /* Of `window` in `messages` */
+    size_t window_tokens; /* Cost of the messages from `window` onwards */
+    aoStr *pinned; /* System messages from before `window`, always sent */
+    size_t pinned_tokens;
+
+    int cache_ttl;    /* Seconds a cached answer is good for, 0 to not cache.
+                         Needs `db` */
+    size_t cache_max; /* Bytes of answers kept */
 } openAiCtx;
 
+/* Called when an asynchronous request completes, `resp` is NULL if it failed
+ * and is released once the callback returns */
+typedef void openAiCallback(openAiCtx *ctx, json *resp, void *privdata);
+
 openAiCtx *openAiCtxNew(char *apikey, char *model, char *organisation);
 void openAiCtxRelease(openAiCtx *ctx);
 void openAiCtxPrint(openAiCtx *ctx);
@@ -83,16 +142,44 @@ void openAiCtxSetTopP(openAiCtx *ctx, float top_p);
 void openAiCtxSetChatHistory(openAiCtx *ctx, list *chat);
 void openAiCtxSetChatLen(openAiCtx *ctx, size_t history_len);
 void openAiCtxSetFlags(openAiCtx *ctx, int flags);
+void openAiCtxSetContextWindow(openAiCtx *ctx, size_t context_window);
+void openAiCtxSetCache(openAiCtx *ctx, int ttl, size_t max_bytes);
+void openAiCtxSetDurability(openAiCtx *ctx, SqlDurability durability);
+void openAiCtxSetRenderFrame(openAiCtx *ctx, int frame_ms);
+void openAiCtxSetRenderMarkdown(openAiCtx *ctx, int markdown);
 void openAiCtxHistoryPrint(openAiCtx *ctx);
 void openAiCtxHistoryClear(openAiCtx *ctx);
 
+/* Token counting */
+void openAiCtxTokenizerInit(openAiCtx *ctx);
+int openAiCtxSetTokenizer(openAiCtx *ctx, char *path);
+size_t openAiCtxCountTokens(openAiCtx *ctx, char *text, size_t len);
+int openAiMessageTokens(openAiCtx *ctx, openAiMessage *msg);
+size_t openAiCtxHistoryTokens(openAiCtx *ctx);
+size_t openAiCtxHistoryBudget(openAiCtx *ctx);
+size_t openAiCtxSentTokens(openAiCtx *ctx);
+size_t openAiModelContextWindow(char *model);
+
 void openAiChatHistoryAppend(openAiCtx *ctx, int role, char *name, aoStr *data);
 json *openAiListModels(openAiCtx *ctx);
 json *openAiChat(openAiCtx *ctx, char *msg);
 void openAiChatStream(openAiCtx *ctx, char *msg);
 
+/* Asynchronous API, requests are only submitted and make progress when
+ * `openAiRun` is called */
+httpRequest *openAiListModelsAsync(openAiCtx *ctx, openAiCallback *callback,
+                                   void *privdata);
+httpRequest *openAiChatAsync(openAiCtx *ctx, char *msg,
+                             openAiCallback *callback, void *privdata);
+httpRequest *openAiChatStreamAsync(openAiCtx *ctx, char *msg);
+void openAiRun(openAiCtx *ctx);
+void openAiCtxCancel(openAiCtx *ctx);
+
 /* Database commands */
 void openAiCtxDbInit(openAiCtx *ctx);
+void openAiCtxDbCheckWrites(openAiCtx *ctx);
+void openAiCtxDbFlush(openAiCtx *ctx);
+void openAiCtxDbClose(openAiCtx *ctx);
 void openAiCtxDbNewChat(openAiCtx *ctx);
 void openAiCtxDbRenameChat(openAiCtx *ctx, int id, char *name);
 void openAiCtxDbDeleteChatById(openAiCtx *ctx, int id);
@@ -102,6 +189,7 @@ void openAiCtxLoadChatHistoryById(openAiCtx *ctx, int chat_id);
 void openAiCtxDbSaveHistory(openAiCtx *ctx);
 int *openAiCtxDbGetChatIds(openAiCtx *ctx, int *count);
 list *openAiCtxGetChats(openAiCtx *ctx);
+list *openAiCtxDbSearch(openAiCtx *ctx, char *query, int limit);
 
 void openAiCtxHistoryDel(openAiCtx *ctx, int msg_id);
 
@@ -0,0 +1,487 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aostr.h"
+#include "render.h"
+
+static long long renderNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Markdown is only styled for a terminal, and not if NO_COLOR is set */
+renderer *renderNew(FILE *out, int frame_ms) {
+    renderer *r = (renderer *)malloc(sizeof(renderer));
+    r->out = out;
+    r->pending = aoStrAlloc(RENDER_MAX_PENDING);
+    aoStrSetLen(r->pending, 0);
+    r->frame_ms = frame_ms;
+    r->last_flush = 0;
+    r->flushes = 0;
+    r->markdown = isatty(fileno(out)) && getenv("NO_COLOR") == NULL;
+    memset(&r->md, 0, sizeof(renderMarkdown));
+    r->md.line_start = 1;
+    return r;
+}
+
+void renderRelease(renderer *r) {
+    if (r) {
+        renderFlush(r);
+        aoStrRelease(r->pending);
+        free(r);
+    }
+}
+
+void renderSetFrame(renderer *r, int frame_ms) {
+    renderFlush(r);
+    r->frame_ms = frame_ms;
+}
+
+void renderSetMarkdown(renderer *r, int markdown) {
+    renderEnd(r);
+    r->markdown = markdown;
+}
+
+/*=============================================================================
+ * Markdown, styled a byte at a time
+ *============================================================================*/
+
+#define RENDER_STYLE_HEADING (1 << 0)
+#define RENDER_STYLE_QUOTE   (1 << 1)
+#define RENDER_STYLE_FENCE   (1 << 2)
+#define RENDER_STYLE_CODE    (1 << 3)
+#define RENDER_STYLE_BOLD    (1 << 4)
+#define RENDER_STYLE_BULLET  (1 << 5)
+#define RENDER_STYLE_STRING  (1 << 6)
+#define RENDER_STYLE_COMMENT (1 << 7)
+#define RENDER_STYLE_NUMBER  (1 << 8)
+
+/* SGR parameters of each style bit, in bit order */
+static char *render_style_sgr[] = {
+        ";1;35", /* HEADING */
+        ";2;3",  /* QUOTE */
+        ";2",    /* FENCE */
+        ";36",   /* CODE */
+        ";1",    /* BOLD */
+        ";33",   /* BULLET */
+        ";32",   /* STRING */
+        ";90",   /* COMMENT */
+        ";35",   /* NUMBER */
+};
+
+/* Style the next byte should have given where the markdown is */
+static int renderMarkdownStyle(renderMarkdown *md) {
+    int style = 0;
+
+    if (md->line == RENDER_MD_LINE_FENCE) {
+        return RENDER_STYLE_FENCE;
+    }
+    if (md->line == RENDER_MD_LINE_HEADING) {
+        style |= RENDER_STYLE_HEADING;
+    } else if (md->line == RENDER_MD_LINE_QUOTE) {
+        style |= RENDER_STYLE_QUOTE;
+    }
+
+    if (md->fence) {
+        switch (md->token) {
+        case RENDER_MD_CODE_STRING:
+            style |= RENDER_STYLE_STRING;
+            break;
+        case RENDER_MD_CODE_COMMENT:
+            style |= RENDER_STYLE_COMMENT;
+            break;
+        case RENDER_MD_CODE_NUMBER:
+            style |= RENDER_STYLE_NUMBER;
+            break;
+        }
+        return style;
+    }
+
+    if (md->code) {
+        style |= RENDER_STYLE_CODE;
+    }
+    if (md->bold) {
+        style |= RENDER_STYLE_BOLD;
+    }
+    if (md->bullet) {
+        style |= RENDER_STYLE_BULLET;
+    }
+    return style;
+}
+
+/* Write 'c' in the current style, changing to it first if needs be */
+static void renderPut(renderer *r, char c) {
+    int style = renderMarkdownStyle(&r->md);
+
+    if (style != r->md.style) {
+        aoStrCatLen(r->pending, "\033[0", 3);
+        for (int i = 0; style >> i; ++i) {
+            if (style & (1 << i)) {
+                aoStrCat(r->pending, render_style_sgr[i]);
+            }
+        }
+        aoStrPutChar(r->pending, 'm');
+        r->md.style = style;
+    }
+    aoStrPutChar(r->pending, c);
+}
+
+/* Outside of a code block */
+static void renderMarkdownInline(renderer *r, char c) {
+    renderMarkdown *md = &r->md;
+
+    if (md->star) {
+        md->star = 0;
+        if (c == '*') {
+            /* Opening "**" is bold along with the text, closing is not */
+            md->bold = !md->bold;
+            if (md->bold) {
+                renderPut(r, '*');
+                renderPut(r, '*');
+            } else {
+                md->bold = 1;
+                renderPut(r, '*');
+                renderPut(r, '*');
+                md->bold = 0;
+            }
+            return;
+        }
+        renderPut(r, '*');
+    }
+
+    if (c == '`') {
+        if (md->code) {
+            renderPut(r, c);
+            md->code = 0;
+        } else {
+            md->code = 1;
+            renderPut(r, c);
+        }
+    } else if (c == '*' && !md->code) {
+        md->star = 1;
+    } else {
+        renderPut(r, c);
+    }
+}
+
+/* Inside a code block, only what can be known from the byte in hand is
+ * highlighted: strings, comments and numbers */
+static void renderMarkdownBlock(renderer *r, char c) {
+    renderMarkdown *md = &r->md;
+
+    if (md->slash) {
+        md->slash = 0;
+        if (c == '/') {
+            md->token = RENDER_MD_CODE_COMMENT;
+            renderPut(r, '/');
+            renderPut(r, '/');
+            return;
+        }
+        renderPut(r, '/');
+    }
+
+    switch (md->token) {
+    case RENDER_MD_CODE_STRING:
+        renderPut(r, c);
+        if (md->escaped) {
+            md->escaped = 0;
+        } else if (c == '\\') {
+            md->escaped = 1;
+        } else if (c == md->quote) {
+            md->token = RENDER_MD_CODE_NONE;
+        }
+        return;
+    case RENDER_MD_CODE_COMMENT:
+        renderPut(r, c);
+        return;
+    case RENDER_MD_CODE_NUMBER:
+        if (isalnum((unsigned char)c) || c == '.' || c == '_') {
+            renderPut(r, c);
+            return;
+        }
+        md->token = RENDER_MD_CODE_NONE;
+        break;
+    }
+
+    if (c == '/') {
+        md->slash = 1;
+        md->word = 0;
+    } else if (c == '"' || c == '\'') {
+        md->token = RENDER_MD_CODE_STRING;
+        md->quote = c;
+        md->escaped = 0;
+        md->word = 0;
+        renderPut(r, c);
+    } else if (isdigit((unsigned char)c) && !md->word) {
+        md->token = RENDER_MD_CODE_NUMBER;
+        md->word = 1;
+        renderPut(r, c);
+    } else {
+        md->word = isalnum((unsigned char)c) || c == '_';
+        renderPut(r, c);
+    }
+}
+
+/* The held prefix turned out to be an ordinary line */
+static void renderMarkdownReplay(renderer *r) {
+    renderMarkdown *md = &r->md;
+    char prefix[RENDER_MD_PREFIX_MAX];
+    int len = md->prefix_len;
+    int i = 0;
+
+    memcpy(prefix, md->prefix, len);
+    md->prefix_len = 0;
+    md->line_start = 0;
+
+    if (md->fence) {
+        while (i < len && prefix[i] == ' ') {
+            i++;
+        }
+        /* Shell, python and the preprocessor */
+        if (i < len && prefix[i] == '#') {
+            md->token = RENDER_MD_CODE_COMMENT;
+        }
+        for (i = 0; i < len; ++i) {
+            renderMarkdownBlock(r, prefix[i]);
+        }
+    } else {
+        for (i = 0; i < len; ++i) {
+            renderMarkdownInline(r, prefix[i]);
+        }
+    }
+}
+
+/* Write the held prefix as the line it turned out to be */
+static void renderMarkdownLine(renderer *r, int line) {
+    renderMarkdown *md = &r->md;
+    md->line = line;
+    md->line_start = 0;
+    for (int i = 0; i < md->prefix_len; ++i) {
+        renderPut(r, md->prefix[i]);
+    }
+    md->prefix_len = 0;
+}
+
+/* Write the held prefix with the marker 'start' to 'end' styled as a list
+ * bullet */
+static void renderMarkdownBullet(renderer *r, int start, int end) {
+    renderMarkdown *md = &r->md;
+    for (int i = 0; i < md->prefix_len; ++i) {
+        md->bullet = i >= start && i < end;
+        renderPut(r, md->prefix[i]);
+    }
+    md->bullet = 0;
+    md->prefix_len = 0;
+    md->line_start = 0;
+}
+
+/* Hold the start of a line until it is clear what kind of line it is. Only
+ * ever a handful of bytes, the first that cannot be part of a marker
+ * decides it */
+static void renderMarkdownLineStart(renderer *r, char c) {
+    renderMarkdown *md = &r->md;
+    char *p;
+    int n, i = 0, spaces;
+
+    md->prefix[md->prefix_len++] = c;
+    while (i < md->prefix_len && md->prefix[i] == ' ') {
+        i++;
+    }
+    spaces = i;
+    p = md->prefix + spaces;
+    n = md->prefix_len - spaces;
+
+    /* ``` opens or closes a block */
+    for (i = 0; i < n && p[i] == '`'; ++i)
+        ;
+    if (n == 3 && i == n) {
+        md->fence = !md->fence;
+        renderMarkdownLine(r, RENDER_MD_LINE_FENCE);
+        return;
+    }
+
+    /* Every branch below may hold on to the prefix, which has no room left
+     * once it is full */
+    if (md->prefix_len == RENDER_MD_PREFIX_MAX) {
+        renderMarkdownReplay(r);
+        return;
+    }
+
+    if (n == 0 || (i == n && n < 3)) {
+        return;
+    }
+
+    if (md->fence) {
+        renderMarkdownReplay(r);
+        return;
+    }
+
+    switch (p[0]) {
+    case '#':
+        for (i = 1; i < n && p[i] == '#'; ++i)
+            ;
+        if (i == n && n <= 6) {
+            return;
+        }
+        /* Seven or more are text, and past `n` is a previous line */
+        if (i <= 6 && p[i] == ' ') {
+            renderMarkdownLine(r, RENDER_MD_LINE_HEADING);
+            return;
+        }
+        break;
+
+    case '>':
+        renderMarkdownLine(r, RENDER_MD_LINE_QUOTE);
+        return;
+
+    case '-':
+    case '+':
+    case '*':
+        if (n == 1) {
+            return;
+        }
+        if (p[1] == ' ') {
+            renderMarkdownBullet(r, spaces, spaces + 1);
+            return;
+        }
+        break;
+
+    default:
+        if (isdigit((unsigned char)p[0])) {
+            for (i = 1; i < n && isdigit((unsigned char)p[i]); ++i)
+                ;
+            if (i == n) {
+                return;
+            }
+            if (p[i] == '.' || p[i] == ')') {
+                if (i + 1 == n) {
+                    return;
+                }
+                if (p[i + 1] == ' ') {
+                    renderMarkdownBullet(r, spaces, spaces + i + 1);
+                    return;
+                }
+            }
+        }
+        break;
+    }
+    renderMarkdownReplay(r);
+}
+
+/* Let go of anything held back, it is not going to be added to */
+static void renderMarkdownRelease(renderer *r) {
+    renderMarkdown *md = &r->md;
+
+    if (md->line_start && md->prefix_len) {
+        renderMarkdownReplay(r);
+    }
+    if (md->star) {
+        md->star = 0;
+        renderPut(r, '*');
+    }
+    if (md->slash) {
+        md->slash = 0;
+        renderPut(r, '/');
+    }
+}
+
+static void renderMarkdownByte(renderer *r, char c) {
+    renderMarkdown *md = &r->md;
+
+    if (c == '\n') {
+        /* Nothing inline carries over to the next line, a block does */
+        renderMarkdownRelease(r);
+        md->line = RENDER_MD_LINE_TEXT;
+        md->code = 0;
+        md->bold = 0;
+        md->token = RENDER_MD_CODE_NONE;
+        md->word = 0;
+        renderPut(r, c);
+        md->line_start = 1;
+    } else if (md->line_start) {
+        renderMarkdownLineStart(r, c);
+    } else if (md->fence) {
+        renderMarkdownBlock(r, c);
+    } else {
+        renderMarkdownInline(r, c);
+    }
+}
+
+/* The answer is over, write out what was held back and go back to the
+ * terminal's own style */
+void renderEnd(renderer *r) {
+    if (r->markdown) {
+        renderMarkdownRelease(r);
+        if (r->md.style) {
+            aoStrCat(r->pending, "\033[0m");
+        }
+        memset(&r->md, 0, sizeof(renderMarkdown));
+        r->md.line_start = 1;
+    }
+    renderFlush(r);
+}
+
+/* Everything pending goes out in one write */
+void renderFlush(renderer *r) {
+    if (r->pending->len == 0) {
+        return;
+    }
+    fwrite(r->pending->data, 1, r->pending->len, r->out);
+    fflush(r->out);
+    aoStrSetLen(r->pending, 0);
+    r->last_flush = renderNow();
+    r->flushes++;
+}
+
+/* Flush if a frame has passed since the last one */
+void renderTick(renderer *r) {
+    if (r->pending->len &&
+        renderNow() - r->last_flush >= (long long)r->frame_ms * 1000) {
+        renderFlush(r);
+    }
+}
+
+/* Text after a quiet spell goes out at once, anything that follows it
+ * within the frame waits for the frame to end */
+void renderWrite(renderer *r, const char *str, size_t len) {
+    if (r->markdown) {
+        for (size_t i = 0; i < len; ++i) {
+            renderMarkdownByte(r, str[i]);
+        }
+    } else {
+        aoStrCatLen(r->pending, str, len);
+    }
+    if (r->frame_ms == 0 || r->pending->len >= RENDER_MAX_PENDING) {
+        renderFlush(r);
+    } else {
+        renderTick(r);
+    }
+}
+
+/* How long an event loop can sleep before the pending text is due, or
+ * 'idle_ms' if there is nothing to write */
+int renderTimeout(renderer *r, int idle_ms) {
+    long long due;
+
+    if (r->pending->len == 0) {
+        return idle_ms;
+    }
+    due = r->last_flush + (long long)r->frame_ms * 1000 - renderNow();
+    if (due <= 0) {
+        return 0;
+    }
+    /* Round up, waking early would only go back to sleep */
+    due = (due + 999) / 1000;
+    return due < idle_ms ? (int)due : idle_ms;
+}
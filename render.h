@@ -0,0 +1,80 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdio.h>
+
+#include "aostr.h"
+
+/* A frame is about as often as the eye notices, tokens that arrive within
+ * one are written together */
+#define RENDER_FRAME_MS (16)
+/* Written straight away past this, whatever the clock says */
+#define RENDER_MAX_PENDING (4096)
+
+/* Most of a line held back while deciding whether it starts a heading, list,
+ * quote or fence */
+#define RENDER_MD_PREFIX_MAX (16)
+
+/* What a line turned out to be */
+#define RENDER_MD_LINE_TEXT    (0)
+#define RENDER_MD_LINE_HEADING (1)
+#define RENDER_MD_LINE_QUOTE   (2)
+#define RENDER_MD_LINE_FENCE   (3) /* The ``` line opening or closing a block */
+
+/* Tokens inside a code block that can be told apart from their first
+ * character */
+#define RENDER_MD_CODE_NONE    (0)
+#define RENDER_MD_CODE_STRING  (1)
+#define RENDER_MD_CODE_COMMENT (2)
+#define RENDER_MD_CODE_NUMBER  (3)
+
+/* Where a streamed answer is in its markdown. Each byte moves the state on
+ * and is styled there and then, nothing already written is looked at again.
+ * A few bytes are held back when what they are depends on the next one */
+typedef struct renderMarkdown {
+    int line_start;   /* Still deciding what the line is */
+    char prefix[RENDER_MD_PREFIX_MAX]; /* Held while deciding */
+    int prefix_len;
+    int line;         /* RENDER_MD_LINE_* */
+    int fence;        /* Inside a ``` block */
+    int code;         /* Inside `inline code` */
+    int bold;         /* Inside **bold** */
+    int star;         /* Holding a '*' that may be half of "**" */
+    int bullet;       /* Writing a list marker */
+    int token;        /* RENDER_MD_CODE_* inside a block */
+    char quote;       /* Closes the string `token` */
+    int escaped;      /* Last byte of a string was a backslash */
+    int slash;        /* Holding a '/' that may start a comment */
+    int word;         /* Last byte in a block was part of an identifier */
+    int style;        /* Last style written, see `renderMarkdownStyle` */
+} renderMarkdown;
+
+/* Sits between streamed text and the terminal, turning a write per token into
+ * a write per frame. `frame_ms` of 0 writes every token as it comes */
+typedef struct renderer {
+    FILE *out;
+    aoStr *pending; /* Written since the last flush */
+    int frame_ms;
+    long long last_flush; /* Monotonic microseconds */
+    size_t flushes;       /* Writes that reached `out` */
+    int markdown;         /* Style the text as it goes */
+    renderMarkdown md;
+} renderer;
+
+renderer *renderNew(FILE *out, int frame_ms);
+void renderRelease(renderer *r);
+void renderSetFrame(renderer *r, int frame_ms);
+void renderSetMarkdown(renderer *r, int markdown);
+void renderWrite(renderer *r, const char *str, size_t len);
+void renderEnd(renderer *r);
+int renderTimeout(renderer *r, int idle_ms);
+void renderTick(renderer *r);
+void renderFlush(renderer *r);
+
+#endif
@@ -4,35 +4,178 @@
  *
  * This code is released under the BSD 2 clause license.
  * See the COPYING file for more information. */
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "aostr.h"
+#include "dict.h"
 #include "list.h"
 #include "panic.h"
 #include "sql.h"
 
-sqlCtx *sqlCtxNew(char *dbname) {
+static void sqlCachedStmtRelease(void *_cached) {
+    sqlCachedStmt *cached = (sqlCachedStmt *)_cached;
+    /* The key is freed by the dict */
+    sqlite3_finalize(cached->stmt);
+    free(cached->col);
+    free(cached);
+}
+
+static dictType sql_stmt_table_type = {
+        .freeKey = free,
+        .freeValue = sqlCachedStmtRelease,
+        .keyCmp = dictStrCmp,
+        .hashFunction = dictGenericHashFunction,
+};
+
+/* Pragmas for each `SqlDurability`. Common to all, a page cache of 8mb
+ * (negative sizes are in kb), temporary tables in memory and reads through
+ * mmap */
+static char *sql_durability_pragmas[] = {
+        [SQL_DURABILITY_SAFE] = "PRAGMA journal_mode=DELETE;"
+                                "PRAGMA synchronous=FULL;"
+                                "PRAGMA cache_size=-8192;"
+                                "PRAGMA temp_store=MEMORY;"
+                                "PRAGMA mmap_size=67108864;",
+        [SQL_DURABILITY_BALANCED] = "PRAGMA journal_mode=WAL;"
+                                    "PRAGMA synchronous=NORMAL;"
+                                    "PRAGMA cache_size=-8192;"
+                                    "PRAGMA temp_store=MEMORY;"
+                                    "PRAGMA mmap_size=67108864;",
+        [SQL_DURABILITY_FAST] = "PRAGMA journal_mode=WAL;"
+                                "PRAGMA synchronous=OFF;"
+                                "PRAGMA cache_size=-8192;"
+                                "PRAGMA temp_store=MEMORY;"
+                                "PRAGMA mmap_size=67108864;",
+};
+
+static char *sql_durability_names[] = {
+        [SQL_DURABILITY_SAFE] = "safe",
+        [SQL_DURABILITY_BALANCED] = "balanced",
+        [SQL_DURABILITY_FAST] = "fast",
+};
+
+/* Returns -1 if 'name' is not one of "safe", "balanced" or "fast" */
+int sqlDurabilityFromName(char *name) {
+    int len = sizeof(sql_durability_names) / sizeof(sql_durability_names[0]);
+    for (int i = 0; i < len; ++i) {
+        if (!strcasecmp(name, sql_durability_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char *sqlDurabilityName(SqlDurability durability) {
+    return sql_durability_names[durability];
+}
+
+sqlCtx *sqlCtxNew(char *dbname, SqlDurability durability) {
     sqlite3 *db;
+    char *err;
     int ok = sqlite3_open(dbname, &db);
     if (ok != SQLITE_OK) {
         const char *s = sqlite3_errmsg(db);
         printf("NOT OK: %s\n", s);
         return NULL;
     }
+    sqlite3_busy_timeout(db, SQL_BUSY_TIMEOUT_MS);
+    if (sqlite3_exec(db, sql_durability_pragmas[durability], NULL, NULL,
+                     &err) != SQLITE_OK) {
+        /* Still usable, only slower or less safe than asked for */
+        warning("Failed to set durability of %s: %s\n", dbname, err);
+        sqlite3_free(err);
+    }
+
     sqlCtx *ctx = (sqlCtx *)malloc(sizeof(sqlCtx));
     ctx->dbname = dbname;
     ctx->conn = db;
+    ctx->stmts = dictNew(&sql_stmt_table_type);
+    ctx->lru = listNew();
+    ctx->stmts_max = SQL_STMT_CACHE_SIZE;
     return ctx;
 }
 
 void sqlRelease(sqlCtx *ctx) {
+    /* Everything has to be finalized before the connection will close */
+    dictRelease(ctx->stmts);
+    listRelease(ctx->lru, NULL);
     sqlite3_close(ctx->conn);
     free(ctx);
 }
 
+/* Most recently used goes to the tail */
+static void sqlStmtCacheTouch(sqlCtx *ctx, list *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = ctx->lru->prev;
+    node->next = ctx->lru;
+    ctx->lru->prev->next = node;
+    ctx->lru->prev = node;
+}
+
+/* Make room by finalizing the least recently used statement that is not
+ * being iterated over */
+static void sqlStmtCacheEvict(sqlCtx *ctx) {
+    list *node = ctx->lru->next;
+    sqlCachedStmt *cached;
+
+    while (node != ctx->lru) {
+        cached = node->value;
+        if (!cached->in_use) {
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            free(node);
+            dictDelete(ctx->stmts, cached->sql);
+            return;
+        }
+        node = node->next;
+    }
+}
+
+/* A statement for 'sql' ready to be bound, compiled only the first time it is
+ * seen. NULL if it is already in use, then the caller prepares its own */
+static sqlCachedStmt *sqlStmtCacheGet(sqlCtx *ctx, char *sql) {
+    sqlCachedStmt *cached = dictGet(ctx->stmts, sql);
+    sqlite3_stmt *stmt;
+
+    if (cached) {
+        if (cached->in_use) {
+            return NULL;
+        }
+        sqlStmtCacheTouch(ctx, cached->node);
+        sqlite3_reset(cached->stmt);
+        sqlite3_clear_bindings(cached->stmt);
+        return cached;
+    }
+
+    if (sqlite3_prepare_v2(ctx->conn, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL;
+    }
+
+    if ((int)ctx->stmts->size >= ctx->stmts_max) {
+        sqlStmtCacheEvict(ctx);
+    }
+
+    cached = malloc(sizeof(sqlCachedStmt));
+    cached->sql = strdup(sql);
+    cached->stmt = stmt;
+    cached->in_use = 0;
+    cached->cols = sqlite3_column_count(stmt);
+    cached->col = (sqlColumn *)malloc(sizeof(sqlColumn) * cached->cols);
+    listAppend(ctx->lru, cached);
+    cached->node = ctx->lru->prev;
+    dictSet(ctx->stmts, cached->sql, cached);
+    return cached;
+}
+
 sqlPreparedStmt *sqlPrepare(sqlCtx *ctx, char *sql) {
     sqlPreparedStmt *pstmt = (sqlPreparedStmt *)malloc(sizeof(sqlPreparedStmt));
     sqlite3_prepare_v2(ctx->conn, sql, -1, &(pstmt->stmt), NULL);
@@ -55,12 +198,74 @@ void sqlFinalizePrepared(sqlPreparedStmt *pstmt) {
 char *sqlExecRaw(sqlCtx *ctx, char *sql) {
     char *errmsg;
     int rc = sqlite3_exec(ctx->conn, sql, 0, 0, &errmsg);
-    if (!rc) {
+    if (rc != SQLITE_OK) {
         return errmsg;
     }
     return NULL;
 }
 
+static int sqlUserVersion(sqlCtx *ctx) {
+    sqlRow row;
+    int version = -1;
+    if (sqlSelect(ctx, &row, "PRAGMA user_version;", NULL, 0)) {
+        while (sqlIter(&row)) {
+            version = row.col[0].integer;
+        }
+    }
+    return version;
+}
+
+/* Bring the schema up to date. 'migrations[i]' takes the database from
+ * version i to i + 1, where the version is kept in `PRAGMA user_version`
+ * and a new database starts at 0. Each runs in a transaction of its own
+ * holding the write lock, so another process opening the database at the
+ * same time does not run it twice. Only ever append to 'migrations'.
+ *
+ * Returns 0 if a migration failed, which leaves the database at the version
+ * before it */
+int sqlMigrate(sqlCtx *ctx, char **migrations, int count) {
+    int version;
+    char *err;
+    aoStr *sql;
+
+    while (1) {
+        if ((err = sqlExecRaw(ctx, "BEGIN IMMEDIATE;")) != NULL) {
+            warning("Failed to lock %s: %s\n", ctx->dbname, err);
+            sqlite3_free(err);
+            return 0;
+        }
+        if ((version = sqlUserVersion(ctx)) >= count) {
+            /* Newer versions are left alone */
+            sqlCommit(ctx);
+            return 1;
+        }
+        if (version == -1) {
+            warning("Failed to read the version of %s\n", ctx->dbname);
+            sqlRollback(ctx);
+            return 0;
+        }
+
+        sql = aoStrAlloc(128);
+        aoStrCatPrintf(sql, "%s\nPRAGMA user_version = %d;\nCOMMIT;",
+                       migrations[version], version + 1);
+        err = sqlExecRaw(ctx, sql->data);
+        aoStrRelease(sql);
+        if (err) {
+            warning("Migrating %s to version %d failed: %s\n", ctx->dbname,
+                    version + 1, err);
+            sqlite3_free(err);
+            sqlRollback(ctx);
+            return 0;
+        }
+    }
+}
+
+/* rowid of the last row inserted through 'ctx', another connection's inserts
+ * do not change it */
+long sqlLastInsertId(sqlCtx *ctx) {
+    return (long)sqlite3_last_insert_rowid(ctx->conn);
+}
+
 int sqlExecPrepared(sqlPreparedStmt *pstmt, sqlRow *row, sqlParam *params) {
     int rc = 0;
     sqlReset(pstmt);
@@ -95,8 +300,10 @@ int sqlExecPrepared(sqlPreparedStmt *pstmt, sqlRow *row, sqlParam *params) {
     rc = sqlite3_step(pstmt->stmt);
     if (rc == SQLITE_ROW && row) {
         row->stmt = pstmt->stmt;
-        row->cols = 0;
-        row->col = NULL;
+        row->cols = sqlite3_column_count(pstmt->stmt);
+        row->col = (sqlColumn *)malloc(sizeof(sqlColumn) * row->cols);
+        row->cached = NULL;
+        row->started = 0;
     }
 
     return rc;
@@ -106,16 +313,21 @@ static int sqlExecQuery(sqlCtx *ctx, sqlRow *row, char *sql, sqlParam *params,
                         int param_count) {
     int rc = SQLITE_ERROR;
     sqlite3_stmt *stmt = NULL;
+    sqlCachedStmt *cached = sqlStmtCacheGet(ctx, sql);
 
     if (row) {
         row->stmt = NULL;
+        row->cached = NULL;
     }
 
-    rc = sqlite3_prepare_v2(ctx->conn, sql, -1, &stmt, NULL);
-
-    if (rc != SQLITE_OK) {
-        warning("QUERY not ok: %s\n", sql);
-        goto err;
+    if (cached) {
+        stmt = cached->stmt;
+    } else {
+        rc = sqlite3_prepare_v2(ctx->conn, sql, -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            warning("QUERY not ok: %s\n", sql);
+            goto err;
+        }
     }
 
     for (int i = 0; i < param_count; ++i) {
@@ -147,13 +359,28 @@ static int sqlExecQuery(sqlCtx *ctx, sqlRow *row, char *sql, sqlParam *params,
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW && row) {
         row->stmt = stmt;
-        row->cols = 0;
-        row->col = NULL;
+        row->cols = sqlite3_column_count(stmt);
+        row->cached = cached;
+        row->started = 0;
+        if (cached) {
+            cached->in_use = 1;
+            if (row->cols > cached->cols) {
+                cached->cols = row->cols;
+                cached->col = (sqlColumn *)realloc(
+                        cached->col, sizeof(sqlColumn) * cached->cols);
+            }
+            row->col = cached->col;
+        } else {
+            row->col = (sqlColumn *)malloc(sizeof(sqlColumn) * row->cols);
+        }
         stmt = NULL;
     }
 
 err:
-    if (stmt) {
+    if (cached && stmt) {
+        /* Let go of any locks, the bindings are cleared on the next use */
+        sqlite3_reset(stmt);
+    } else if (stmt) {
         sqlite3_finalize(stmt);
     }
     return rc;
@@ -163,8 +390,14 @@ void sqlRowRelease(sqlRow *row) {
     if (row->stmt == NULL) {
         return;
     }
-    free(row->col);
-    sqlite3_finalize(row->stmt);
+    if (row->cached) {
+        sqlite3_reset(row->stmt);
+        row->cached->in_use = 0;
+        row->cached = NULL;
+    } else {
+        free(row->col);
+        sqlite3_finalize(row->stmt);
+    }
     row->col = NULL;
     row->stmt = NULL;
 }
@@ -178,24 +411,386 @@ int sqlQuery(sqlCtx *ctx, char *sql, sqlParam *params, int param_count) {
     return sqlExecQuery(ctx, NULL, sql, params, param_count) == SQLITE_DONE;
 }
 
+/* INSERT INTO <table> (<columns>) VALUES (?, ?), (?, ?)... */
+static aoStr *sqlInsertBatchSql(char *table, char **columns, int column_count,
+                                int row_count) {
+    aoStr *sql = aoStrAlloc(256);
+
+    aoStrSetLen(sql, 0);
+    aoStrCatPrintf(sql, "INSERT INTO %s (", table);
+    for (int i = 0; i < column_count; ++i) {
+        aoStrCatPrintf(sql, i ? ", %s" : "%s", columns[i]);
+    }
+    aoStrCatLen(sql, ") VALUES ", 9);
+    for (int i = 0; i < row_count; ++i) {
+        aoStrCatLen(sql, i ? ", (" : "(", i ? 3 : 1);
+        for (int j = 0; j < column_count; ++j) {
+            aoStrCatLen(sql, j ? ", ?" : "?", j ? 3 : 1);
+        }
+        aoStrPutChar(sql, ')');
+    }
+    aoStrPutChar(sql, ';');
+    return sql;
+}
+
+/**
+ * Insert 'row_count' rows with as few statements as possible, 'params' holds
+ * 'column_count' parameters for each row one row after the other. Full size
+ * batches share the same sql so stay prepared in the statement cache.
+ *
+ * The rows are not inserted atomically unless called between `sqlBegin` and
+ * `sqlCommit`. Returns 0 if any statement failed.
+ */
+int sqlInsertBatch(sqlCtx *ctx, char *table, char **columns, int column_count,
+                   sqlParam *params, int row_count) {
+    int batch_rows = SQL_BATCH_MAX_PARAMS / column_count;
+    int rows, ok = 1;
+    aoStr *sql = NULL;
+
+    for (int i = 0; i < row_count && ok; i += rows) {
+        rows = row_count - i < batch_rows ? row_count - i : batch_rows;
+        /* Only the last batch can be a different size */
+        if (sql == NULL || rows != batch_rows) {
+            aoStrRelease(sql);
+            sql = sqlInsertBatchSql(table, columns, column_count, rows);
+        }
+        ok = sqlQuery(ctx, sql->data, params + i * column_count,
+                      rows * column_count);
+    }
+    aoStrRelease(sql);
+    return ok;
+}
+
+/* Everything up to `sqlCommit` happens at once and costs one sync to disk
+ * rather than one per statement */
+int sqlBegin(sqlCtx *ctx) {
+    return sqlQuery(ctx, "BEGIN;", NULL, 0);
+}
+
+int sqlCommit(sqlCtx *ctx) {
+    return sqlQuery(ctx, "COMMIT;", NULL, 0);
+}
+
+void sqlRollback(sqlCtx *ctx) {
+    sqlQuery(ctx, "ROLLBACK;", NULL, 0);
+}
+
+/* Every word of 'query' as a quoted string, so punctuation is matched rather
+ * than taken as FTS5 syntax and all of the words have to be present */
+static aoStr *sqlFtsQuery(char *query) {
+    aoStr *match = aoStrAlloc(256);
+    aoStrSetLen(match, 0);
+    char *ptr = query;
+
+    while (*ptr != '\0') {
+        while (isspace(*ptr)) {
+            ptr++;
+        }
+        if (*ptr == '\0') {
+            break;
+        }
+        if (match->len) {
+            aoStrPutChar(match, ' ');
+        }
+        aoStrPutChar(match, '"');
+        while (*ptr != '\0' && !isspace(*ptr)) {
+            if (*ptr == '"') {
+                aoStrPutChar(match, '"');
+            }
+            aoStrPutChar(match, *ptr++);
+        }
+        aoStrPutChar(match, '"');
+    }
+    return match;
+}
+
+void sqlFtsMatchRelease(void *_match) {
+    if (_match) {
+        sqlFtsMatch *match = (sqlFtsMatch *)_match;
+        aoStrRelease(match->snippet);
+        free(match);
+    }
+}
+
+/* Look up the words in 'query' in the FTS5 'table', returning at most 'limit'
+ * `sqlFtsMatch` best first. If 'join' is not NULL it is added to the query
+ * after the table, so only rows with a match in the joined tables are counted
+ * towards 'limit'. Matched terms in the snippet are wrapped in 'open' and
+ * 'close'. Returns NULL if the search could not be run */
+list *sqlFtsSearch(sqlCtx *ctx, char *table, char *join, char *query,
+                   char *open, char *close, int limit) {
+    sqlRow row;
+    sqlFtsMatch *match;
+    list *matches;
+    aoStr *fts_query = sqlFtsQuery(query);
+    aoStr *sql = aoStrAlloc(256);
+    sqlParam params[4] = {
+            {.type = SQL_TEXT, .str = open},
+            {.type = SQL_TEXT, .str = close},
+            {.type = SQL_TEXT, .str = fts_query->data},
+            {.type = SQL_INT, .integer = limit},
+    };
+
+    aoStrCatPrintf(sql,
+                   "SELECT %s.rowid, %s.rank, snippet(%s, 0, ?, ?, '...', 16) "
+                   "FROM %s %s WHERE %s MATCH ? ORDER BY %s.rank LIMIT ?;",
+                   table, table, table, table, join ? join : "", table, table);
+
+    if (fts_query->len == 0) {
+        matches = listNew();
+    } else if (!sqlSelect(ctx, &row, sql->data, params, 4)) {
+        matches = NULL;
+    } else {
+        matches = listNew();
+        while (sqlIter(&row)) {
+            match = (sqlFtsMatch *)malloc(sizeof(sqlFtsMatch));
+            match->rowid = row.col[0].integer;
+            match->rank = row.col[1].floating;
+            match->snippet = aoStrDupRaw(row.col[2].str, row.col[2].len,
+                                         row.col[2].len);
+            listAppend(matches, match);
+        }
+    }
+    aoStrRelease(fts_query);
+    aoStrRelease(sql);
+    return matches;
+}
+
+static void sqlWriterJobRelease(sqlWriterJob *job) {
+    for (int i = 0; i < job->row_count * job->column_count; ++i) {
+        if (job->params[i].type == SQL_TEXT) {
+            free(job->params[i].str);
+        } else if (job->params[i].type == SQL_BLOB) {
+            free(job->params[i].blob);
+        }
+    }
+    free(job->params);
+    free(job);
+}
+
+/* Everything queued since the last wake up is written in one transaction */
+static void *sqlWriterMain(void *_w) {
+    sqlWriter *w = (sqlWriter *)_w;
+    sqlWriterJob **jobs = malloc(sizeof(sqlWriterJob *) * w->size);
+    sqlWriterFailure *failure = NULL;
+    int count, ok;
+
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        while (w->count == 0 && !w->stop) {
+            pthread_cond_wait(&w->not_empty, &w->lock);
+        }
+        if (w->count == 0) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        count = w->count;
+        for (int i = 0; i < count; ++i) {
+            jobs[i] = w->jobs[(w->head + i) % w->size];
+        }
+        w->head = (w->head + count) % w->size;
+        w->count = 0;
+        w->busy = 1;
+        pthread_cond_broadcast(&w->not_full);
+        pthread_mutex_unlock(&w->lock);
+
+        ok = sqlBegin(w->db);
+        for (int i = 0; i < count && ok; ++i) {
+            ok = sqlInsertBatch(w->db, jobs[i]->table, jobs[i]->columns,
+                                jobs[i]->column_count, jobs[i]->params,
+                                jobs[i]->row_count);
+        }
+        if (ok) {
+            ok = sqlCommit(w->db);
+        }
+        /* Reported by whoever queued the jobs, as this thread printing
+         * would land in the middle of whatever they are writing */
+        if (!ok) {
+            failure = (sqlWriterFailure *)malloc(sizeof(sqlWriterFailure));
+            failure->first = jobs[0]->seq;
+            failure->last = jobs[count - 1]->seq;
+            failure->error = strdup(sqlite3_errmsg(w->db->conn));
+            sqlRollback(w->db);
+        }
+        for (int i = 0; i < count; ++i) {
+            sqlWriterJobRelease(jobs[i]);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (!ok) {
+            listAppend(w->failures, failure);
+        }
+        w->busy = 0;
+        if (w->count == 0) {
+            pthread_cond_broadcast(&w->idle);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    free(jobs);
+    return NULL;
+}
+
+/* Opens a connection of its own to 'dbname', which must already have the
+ * tables that will be written to. Returns NULL if the connection or the
+ * thread could not be made */
+sqlWriter *sqlWriterNew(char *dbname, SqlDurability durability, int size) {
+    sqlWriter *w;
+    sqlCtx *db = sqlCtxNew(strdup(dbname), durability);
+
+    if (db == NULL) {
+        return NULL;
+    }
+
+    w = (sqlWriter *)malloc(sizeof(sqlWriter));
+    w->db = db;
+    w->jobs = (sqlWriterJob **)malloc(sizeof(sqlWriterJob *) * size);
+    w->size = size;
+    w->head = 0;
+    w->count = 0;
+    w->busy = 0;
+    w->stop = 0;
+    w->seq = 0;
+    w->failures = listNew();
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->not_empty, NULL);
+    pthread_cond_init(&w->not_full, NULL);
+    pthread_cond_init(&w->idle, NULL);
+
+    if (pthread_create(&w->thread, NULL, sqlWriterMain, w) != 0) {
+        warning("Failed to start writer: %s\n", strerror(errno));
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->not_empty);
+        pthread_cond_destroy(&w->not_full);
+        pthread_cond_destroy(&w->idle);
+        free(db->dbname);
+        sqlRelease(db);
+        listRelease(w->failures, NULL);
+        free(w->jobs);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Queue the same insert as `sqlInsertBatch`. Text and blob parameters are
+ * copied so can be freed as soon as this returns, 'table' and 'columns' are
+ * not and have to outlive the writer. Returns the job's sequence number, which
+ * `sqlWriterFailures` reports if it is rolled back, or 0 if the writer is
+ * stopping */
+long sqlWriterInsert(sqlWriter *w, char *table, char **columns,
+                     int column_count, sqlParam *params, int row_count) {
+    long seq;
+    int count = row_count * column_count;
+    sqlWriterJob *job = (sqlWriterJob *)malloc(sizeof(sqlWriterJob));
+
+    job->table = table;
+    job->columns = columns;
+    job->column_count = column_count;
+    job->row_count = row_count;
+    job->params = (sqlParam *)malloc(sizeof(sqlParam) * count);
+    memcpy(job->params, params, sizeof(sqlParam) * count);
+    for (int i = 0; i < count; ++i) {
+        if (params[i].type == SQL_TEXT) {
+            job->params[i].str = strdup(params[i].str);
+        } else if (params[i].type == SQL_BLOB) {
+            job->params[i].blob = malloc(params[i].blob_len);
+            memcpy(job->params[i].blob, params[i].blob, params[i].blob_len);
+        }
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->count == w->size && !w->stop) {
+        pthread_cond_wait(&w->not_full, &w->lock);
+    }
+    if (w->stop) {
+        pthread_mutex_unlock(&w->lock);
+        sqlWriterJobRelease(job);
+        return 0;
+    }
+    seq = job->seq = ++w->seq;
+    w->jobs[(w->head + w->count) % w->size] = job;
+    w->count++;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+    return seq;
+}
+
+/* Wait until everything queued is in the database */
+void sqlWriterDrain(sqlWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->count > 0 || w->busy) {
+        pthread_cond_wait(&w->idle, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Takes the `sqlWriterFailure`s since the last call, oldest first. Returns
+ * NULL if every job has been committed or is still queued */
+list *sqlWriterFailures(sqlWriter *w) {
+    list *failures = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->failures->next != w->failures) {
+        failures = w->failures;
+        w->failures = listNew();
+    }
+    pthread_mutex_unlock(&w->lock);
+    return failures;
+}
+
+void sqlWriterFailureRelease(void *_failure) {
+    if (_failure) {
+        sqlWriterFailure *failure = (sqlWriterFailure *)_failure;
+        free(failure->error);
+        free(failure);
+    }
+}
+
+/* Writes whatever is still queued before stopping */
+void sqlWriterRelease(sqlWriter *w) {
+    if (w == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->not_empty);
+    pthread_cond_broadcast(&w->not_full);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->not_empty);
+    pthread_cond_destroy(&w->not_full);
+    pthread_cond_destroy(&w->idle);
+    free(w->db->dbname);
+    sqlRelease(w->db);
+    listRelease(w->failures, sqlWriterFailureRelease);
+    free(w->jobs);
+    free(w);
+}
+
 static int sqlIterGeneric(sqlRow *row, int free_row) {
     if (row->stmt == NULL) {
         return 0;
     }
 
-    if (row->col != NULL) {
+    /* The query already stepped to the first row */
+    if (row->started) {
         if (sqlite3_step(row->stmt) != SQLITE_ROW) {
             if (free_row) {
                 sqlRowRelease(row);
+            } else {
+                /* The statement belongs to a `sqlPreparedStmt` */
+                free(row->col);
+                row->col = NULL;
+                row->stmt = NULL;
             }
             return 0;
         }
     }
+    row->started = 1;
 
-    free(row->col);
-    row->cols = sqlite3_data_count(row->stmt);
-    row->col = (sqlColumn *)malloc(row->cols * sizeof(sqlColumn));
-
+    /* Same columns on every row so the buffer is only ever filled in */
     for (int i = 0; i < row->cols; i++) {
         row->col[i].type = sqlite3_column_type(row->stmt, i);
         switch (row->col[i].type) {
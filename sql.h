@@ -7,14 +7,42 @@
 #ifndef SQL_H
 #define SQL_H
 
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdarg.h>
 #include <stddef.h>
 
 #include "aostr.h"
+#include "list.h"
 
 #define SQL_MAX_QUERY_PARAMS (64)
 #define SQL_DB_NAME          "chatgpt-hist.db"
+/* Statements kept prepared by `sqlQuery` and `sqlSelect` */
+#define SQL_STMT_CACHE_SIZE (32)
+/* Most parameters bound to one statement by `sqlInsertBatch`, the lowest
+ * SQLITE_MAX_VARIABLE_NUMBER any sqlite has been built with */
+#define SQL_BATCH_MAX_PARAMS (999)
+
+/* How hard the database works to survive a crash, set when it is opened:
+ *
+ * SAFE - rollback journal, synchronous=FULL. Every commit is on disk before
+ *        it returns.
+ * BALANCED - WAL, synchronous=NORMAL. A commit is an append to the log with
+ *            no sync, the log is synced at checkpoints. Survives the process
+ *            dying, a power cut can lose the last few commits.
+ * FAST - WAL, synchronous=OFF. Nothing is synced, the OS decides when it
+ *        hits the disk */
+typedef enum SqlDurability {
+    SQL_DURABILITY_SAFE,
+    SQL_DURABILITY_BALANCED,
+    SQL_DURABILITY_FAST,
+} SqlDurability;
+
+/* Inserts a `sqlWriter` holds before `sqlWriterInsert` blocks */
+#define SQL_WRITER_QUEUE_SIZE (64)
+
+/* Wait this long for a lock held by another connection before giving up */
+#define SQL_BUSY_TIMEOUT_MS (5000)
 
 typedef enum SqlType {
     SQL_INT = SQLITE_INTEGER,
@@ -27,7 +55,7 @@ typedef enum SqlType {
 typedef struct sqlParam {
     SqlType type;
     union {
-        int integer;
+        sqlite3_int64 integer; /* Wide enough for a time_t */
         double floating;
         char *str;
         struct {
@@ -43,6 +71,8 @@ typedef struct sqlPreparedStmt {
     int *params_type;
 } sqlPreparedStmt;
 
+/* `str` and `blob` are borrowed from sqlite and only valid until the next
+ * `sqlIter`, copy them to keep them */
 typedef struct sqlColumn {
     long len;
     int type;
@@ -54,27 +84,110 @@ typedef struct sqlColumn {
     };
 } sqlColumn;
 
+/* A statement in the cache of a `sqlCtx` */
+typedef struct sqlCachedStmt {
+    char *sql; /* Key in `sqlCtx.stmts` */
+    sqlite3_stmt *stmt;
+    list *node;     /* In `sqlCtx.lru` */
+    int in_use;     /* By a row that has not been iterated to the end */
+    sqlColumn *col; /* Lent to every row of the statement */
+    int cols;       /* Size of `col`, which grows if a change to the schema
+                       gives the statement more columns */
+} sqlCachedStmt;
+
 typedef struct sqlRow {
     sqlite3_stmt *stmt;
     int cols;
-    sqlColumn *col;
+    sqlColumn *col; /* Filled in place by each `sqlIter` */
+    sqlCachedStmt *cached; /* Reset rather than finalized once done, `col`
+                              belongs to it */
+    int started; /* The first row, stepped to by the query, has been read */
 } sqlRow;
 
 typedef struct sqlCtx {
     sqlite3 *conn;
     char *dbname;
+    struct dict *stmts; /* Prepared statements by their sql */
+    list *lru;          /* Of `stmts`, the least recently used at the head */
+    int stmts_max;      /* Most statements kept prepared */
 } sqlCtx;
 
-sqlCtx *sqlCtxNew(char *dbname);
+/* A row found by `sqlFtsSearch` */
+typedef struct sqlFtsMatch {
+    long rowid;
+    double rank;    /* bm25, lower is a better match */
+    aoStr *snippet; /* Of the first column, around the terms that matched */
+} sqlFtsMatch;
+
+/* An insert waiting to be written by a `sqlWriter`, it owns copies of the
+ * parameters */
+typedef struct sqlWriterJob {
+    long seq; /* Returned by `sqlWriterInsert`, in the order jobs are queued */
+    char *table;
+    char **columns;
+    int column_count;
+    sqlParam *params;
+    int row_count;
+} sqlWriterJob;
+
+/* Jobs from 'first' to 'last' were rolled back, found by `sqlWriterFailures` */
+typedef struct sqlWriterFailure {
+    long first;
+    long last;
+    char *error;
+} sqlWriterFailure;
+
+/* Writes inserts on a thread of its own, through a connection of its own, so
+ * whoever queues them does not wait for the disk. The queue is bounded, once
+ * it is full `sqlWriterInsert` blocks until there is room */
+typedef struct sqlWriter {
+    sqlCtx *db;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty; /* Signalled when a job is queued or on stop */
+    pthread_cond_t not_full;  /* Signalled when jobs are taken off */
+    pthread_cond_t idle;      /* Signalled when everything has been written */
+    sqlWriterJob **jobs;      /* Ring buffer of `size` jobs */
+    int size;
+    int head;
+    int count;
+    int busy; /* Writing jobs that are no longer in `jobs` */
+    int stop;
+    long seq;       /* Of the last job queued */
+    list *failures; /* Not yet taken by `sqlWriterFailures` */
+} sqlWriter;
+
+sqlCtx *sqlCtxNew(char *dbname, SqlDurability durability);
+int sqlDurabilityFromName(char *name);
+char *sqlDurabilityName(SqlDurability durability);
 /* Unsafe */
 char *sqlExecRaw(sqlCtx *ctx, char *sql);
+int sqlMigrate(sqlCtx *ctx, char **migrations, int count);
+long sqlLastInsertId(sqlCtx *ctx);
 
 int sqlSelect(sqlCtx *ctx, sqlRow *row, char *stmt, sqlParam *params,
               int count);
 int sqlQuery(sqlCtx *ctx, char *sql, sqlParam *params, int param_count);
+int sqlInsertBatch(sqlCtx *ctx, char *table, char **columns, int column_count,
+                   sqlParam *params, int row_count);
+int sqlBegin(sqlCtx *ctx);
+int sqlCommit(sqlCtx *ctx);
+void sqlRollback(sqlCtx *ctx);
 void sqlRelease(sqlCtx *ctx);
 int sqlIter(sqlRow *row);
 
+list *sqlFtsSearch(sqlCtx *ctx, char *table, char *join, char *query,
+                   char *open, char *close, int limit);
+void sqlFtsMatchRelease(void *match);
+
+sqlWriter *sqlWriterNew(char *dbname, SqlDurability durability, int size);
+long sqlWriterInsert(sqlWriter *w, char *table, char **columns,
+                     int column_count, sqlParam *params, int row_count);
+void sqlWriterDrain(sqlWriter *w);
+list *sqlWriterFailures(sqlWriter *w);
+void sqlWriterFailureRelease(void *failure);
+void sqlWriterRelease(sqlWriter *w);
+
 sqlPreparedStmt *sqlPrepare(sqlCtx *ctx, char *sql);
 int sqlExecPrepared(sqlPreparedStmt *pstmt, sqlRow *row, sqlParam *params);
 int sqlIterPrepared(sqlRow *row);
@@ -0,0 +1,197 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aostr.h"
+#include "sse.h"
+
+/**
+ * Server-sent events framing as used by the streaming completions api:
+ *
+ * data: {"choices":[{"delta":{"content":"Hi"}}]}\n
+ * \n
+ * : a comment, typically a keep-alive\n
+ * data: [DONE]\n
+ * \n
+ *
+ * An event is every `data:` line up until a blank line. Chunks handed to us by
+ * libcurl do not respect line boundaries so a line split across two chunks is
+ * carried over in `line`. If an event lies entirely within a chunk it is
+ * handed to the callback in place, without writing to the chunk, otherwise it
+ * is assembled in `event`. Both buffers are reused for the lifetime of the
+ * parser.
+ */
+sseParser *sseParserNew(sseEventCallback *callback, void *privdata) {
+    sseParser *p;
+
+    if ((p = malloc(sizeof(sseParser))) == NULL) {
+        return NULL;
+    }
+
+    p->line = aoStrAlloc(256);
+    p->event = aoStrAlloc(512);
+    p->callback = callback;
+    p->privdata = privdata;
+    sseParserReset(p);
+    return p;
+}
+
+void sseParserReset(sseParser *p) {
+    aoStrSetLen(p->line, 0);
+    aoStrSetLen(p->event, 0);
+    p->pending = NULL;
+    p->pending_len = 0;
+    p->has_data = 0;
+    p->stopped = 0;
+}
+
+void sseParserRelease(sseParser *p) {
+    if (p) {
+        aoStrRelease(p->line);
+        aoStrRelease(p->event);
+        free(p);
+    }
+}
+
+/* Copy data that points into the chunk into our own buffer as the chunk is
+ * about to go away */
+static void sseParserSpill(sseParser *p) {
+    if (p->pending) {
+        aoStrCatLen(p->event, p->pending, p->pending_len);
+        p->pending = NULL;
+        p->pending_len = 0;
+    }
+}
+
+static void sseParserDispatch(sseParser *p) {
+    sseEvent ev;
+
+    if (!p->has_data) {
+        return;
+    }
+
+    if (p->pending) {
+        ev.data = p->pending;
+        ev.len = p->pending_len;
+    } else {
+        ev.data = aoStrGetData(p->event);
+        ev.len = aoStrLen(p->event);
+    }
+
+    if (ev.len == 6 && !memcmp(ev.data, "[DONE]", 6)) {
+        ev.type = SSE_EVENT_DONE;
+    } else {
+        ev.type = SSE_EVENT_DATA;
+    }
+
+    if (!p->callback(&ev, p->privdata)) {
+        p->stopped = 1;
+    }
+
+    p->pending = NULL;
+    p->pending_len = 0;
+    p->has_data = 0;
+    aoStrSetLen(p->event, 0);
+}
+
+/* `in_chunk` is true if `line` points into the chunk currently being fed, and
+ * thus can be handed out without copying */
+static void sseParserLine(sseParser *p, char *line, size_t len, int in_chunk) {
+    char *value;
+    size_t value_len;
+
+    /* Blank line terminates the event */
+    if (len == 0) {
+        sseParserDispatch(p);
+        return;
+    }
+
+    /* Comment */
+    if (*line == ':') {
+        return;
+    }
+
+    /* `event:`, `id:` and `retry:` are of no interest */
+    if (len < 4 || memcmp(line, "data", 4) != 0 || (len > 4 && line[4] != ':')) {
+        return;
+    }
+
+    value = line + 4;
+    value_len = 0;
+    if (len > 4) {
+        value++;
+        value_len = len - 5;
+        if (value_len && *value == ' ') {
+            value++;
+            value_len--;
+        }
+    }
+
+    if (!p->has_data) {
+        p->has_data = 1;
+        if (in_chunk) {
+            p->pending = value;
+            p->pending_len = value_len;
+        } else {
+            aoStrCatLen(p->event, value, value_len);
+        }
+    } else {
+        /* Multiple data lines are joined with a newline */
+        sseParserSpill(p);
+        aoStrPutChar(p->event, '\n');
+        aoStrCatLen(p->event, value, value_len);
+    }
+}
+
+/* Feed the next chunk of the stream, returns 0 if the callback asked to stop
+ */
+int sseParserFeed(sseParser *p, char *chunk, size_t len) {
+    char *ptr = chunk, *end = chunk + len, *nl;
+    size_t line_len;
+
+    while (ptr < end && !p->stopped) {
+        if ((nl = memchr(ptr, '\n', end - ptr)) == NULL) {
+            aoStrCatLen(p->line, ptr, end - ptr);
+            break;
+        }
+
+        if (aoStrLen(p->line)) {
+            aoStrCatLen(p->line, ptr, nl - ptr);
+            line_len = aoStrLen(p->line);
+            if (line_len && p->line->data[line_len - 1] == '\r') {
+                line_len--;
+            }
+            sseParserLine(p, aoStrGetData(p->line), line_len, 0);
+            aoStrSetLen(p->line, 0);
+        } else {
+            line_len = nl - ptr;
+            if (line_len && ptr[line_len - 1] == '\r') {
+                line_len--;
+            }
+            sseParserLine(p, ptr, line_len, 1);
+        }
+        ptr = nl + 1;
+    }
+
+    sseParserSpill(p);
+    return !p->stopped;
+}
+
+/* The stream has ended, dispatch anything that was not terminated by a blank
+ * line */
+int sseParserFinish(sseParser *p) {
+    if (!p->stopped && aoStrLen(p->line)) {
+        sseParserLine(p, aoStrGetData(p->line), aoStrLen(p->line), 0);
+        aoStrSetLen(p->line, 0);
+    }
+    if (!p->stopped) {
+        sseParserDispatch(p);
+    }
+    return !p->stopped;
+}
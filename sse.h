@@ -0,0 +1,45 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef SSE_H
+#define SSE_H
+
+#include <stddef.h>
+
+#include "aostr.h"
+
+#define SSE_EVENT_DATA (0) /* A complete `data:` payload */
+#define SSE_EVENT_DONE (1) /* The `data: [DONE]` sentinel */
+
+typedef struct sseEvent {
+    int type;
+    char *data; /* Not NUL terminated, may point into the chunk being fed
+                   and is only valid for the duration of the callback */
+    size_t len;
+} sseEvent;
+
+/* Return 0 to stop parsing the rest of the stream */
+typedef int sseEventCallback(sseEvent *ev, void *privdata);
+
+typedef struct sseParser {
+    aoStr *line;   /* A line that was split across chunks */
+    aoStr *event;  /* Data of an event that could not be handed out in place */
+    char *pending; /* Data of the current event when it is still contiguous
+                      in the chunk being fed */
+    size_t pending_len;
+    int has_data;  /* Seen a `data:` field since the last dispatch */
+    int stopped;
+    sseEventCallback *callback;
+    void *privdata;
+} sseParser;
+
+sseParser *sseParserNew(sseEventCallback *callback, void *privdata);
+void sseParserReset(sseParser *p);
+void sseParserRelease(sseParser *p);
+int sseParserFeed(sseParser *p, char *chunk, size_t len);
+int sseParserFinish(sseParser *p);
+
+#endif